@@ -0,0 +1,254 @@
+/*
+ * Copyright 2010 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Deferred frames damage benchmark
+ *
+ * Feeds the damage of a few kinds of screen updates to the dfps damage
+ * boxes, a frame at a time, and clusters them the way dfps_ticker() does
+ * before sending a frame. For each kind, prints per frame:
+ *
+ *  - ops: the boxes drawn, and damaged: their area, overlaps included
+ *  - exact: the area actually covered by them
+ *  - boxes and uploaded: what is sent after clustering
+ *  - bbox: the area of their bounding box, for comparison
+ *  - us: the time spent adding and clustering the boxes
+ *
+ *     dfps-damage [frames]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "qxl.h"
+#include "dfps_damage.h"
+
+#define SCREEN_WIDTH 1920
+#define SCREEN_HEIGHT 1080
+#define MAX_OPS 1024
+
+typedef struct
+{
+    BoxRec	ops[MAX_OPS];
+    int		n_ops;
+} frame_t;
+
+static void
+add_op (frame_t *frame, int x, int y, int width, int height)
+{
+    BoxRec *box;
+
+    if (frame->n_ops == MAX_OPS)
+	return;
+
+    box = &frame->ops[frame->n_ops++];
+    box->x1 = MAX (x, 0);
+    box->y1 = MAX (y, 0);
+    box->x2 = MIN (x + width, SCREEN_WIDTH);
+    box->y2 = MIN (y + height, SCREEN_HEIGHT);
+}
+
+/* A clock at the top right and a blinking caret at the bottom left */
+static void
+make_corners (frame_t *frame, int n)
+{
+    add_op (frame, SCREEN_WIDTH - 80, 4, 64, 16);
+    if (n & 1)
+	add_op (frame, 40, SCREEN_HEIGHT - 40, 2, 16);
+}
+
+/* Glyphs typed along a line, each drawn with its background */
+static void
+make_typing (frame_t *frame, int n)
+{
+    int i;
+
+    for (i = 0; i < 4; ++i)
+    {
+	int col = (n * 4 + i) % 160;
+	int row = (n * 4 + i) / 160 % 50;
+
+	add_op (frame, 200 + col * 8, 100 + row * 16, 8, 16);
+	add_op (frame, 200 + col * 8, 100 + row * 16, 8, 16);
+    }
+    add_op (frame, 200 + ((n * 4 + 4) % 160) * 8, 100 + ((n * 4 + 4) / 160 % 50) * 16, 2, 16);
+}
+
+/* A terminal scrolling by one line */
+static void
+make_scroll (frame_t *frame, int n)
+{
+    add_op (frame, 100, 100, 1200, 800 - 16);
+    add_op (frame, 100, 100 + 800 - 16, 1200, 16);
+}
+
+/* Small updates all over the screen */
+static void
+make_scattered (frame_t *frame, int n)
+{
+    int i;
+
+    for (i = 0; i < 200; ++i)
+    {
+	add_op (frame, rand () % SCREEN_WIDTH, rand () % SCREEN_HEIGHT,
+		4 + rand () % 124, 4 + rand () % 124);
+    }
+}
+
+/* A video drawn in pieces, with a progress bar */
+static void
+make_video (frame_t *frame, int n)
+{
+    int y;
+
+    for (y = 0; y < 360; y += 32)
+	add_op (frame, 640, 360 + y, 640, 32);
+    add_op (frame, 640, 730, (n % 640) + 1, 4);
+}
+
+static const struct
+{
+    const char *name;
+    void (*make) (frame_t *frame, int n);
+} workloads[] =
+{
+    { "corners", make_corners },
+    { "typing", make_typing },
+    { "scroll", make_scroll },
+    { "scattered", make_scattered },
+    { "video", make_video },
+};
+
+#define N_WORKLOADS (sizeof (workloads) / sizeof (workloads[0]))
+
+static uint8_t coverage[SCREEN_WIDTH * SCREEN_HEIGHT];
+
+/* The area covered by boxes, each pixel once */
+static long
+exact_area (const BoxRec *boxes, int n_boxes)
+{
+    long area = 0;
+    int i, y;
+
+    memset (coverage, 0, sizeof coverage);
+
+    for (i = 0; i < n_boxes; ++i)
+    {
+	for (y = boxes[i].y1; y < boxes[i].y2; ++y)
+	{
+	    memset (coverage + y * SCREEN_WIDTH + boxes[i].x1, 1,
+		    boxes[i].x2 - boxes[i].x1);
+	}
+    }
+
+    for (i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; ++i)
+	area += coverage[i];
+
+    return area;
+}
+
+static long
+bbox_area (const BoxRec *boxes, int n_boxes)
+{
+    BoxRec bbox = boxes[0];
+    int i;
+
+    for (i = 1; i < n_boxes; ++i)
+    {
+	bbox.x1 = MIN (bbox.x1, boxes[i].x1);
+	bbox.y1 = MIN (bbox.y1, boxes[i].y1);
+	bbox.x2 = MAX (bbox.x2, boxes[i].x2);
+	bbox.y2 = MAX (bbox.y2, boxes[i].y2);
+    }
+
+    return (long)(bbox.x2 - bbox.x1) * (bbox.y2 - bbox.y1);
+}
+
+static double
+now_us (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int
+main (int argc, char **argv)
+{
+    int n_frames = argc > 1 ? atoi (argv[1]) : 100;
+    frame_t frame;
+    int w, n, i;
+
+    printf ("%-10s %6s %10s %10s %6s %10s %10s %8s\n", "kind", "ops",
+	    "damaged", "exact", "boxes", "uploaded", "bbox", "us");
+
+    for (w = 0; w < N_WORKLOADS; ++w)
+    {
+	dfps_damage_t damage;
+	double ops = 0, exact = 0, boxes = 0, uploaded = 0, bbox = 0;
+	double elapsed = 0;
+
+	memset (&damage, 0, sizeof damage);
+	srand (1);
+
+	for (n = 0; n < n_frames; ++n)
+	{
+	    double start;
+
+	    frame.n_ops = 0;
+	    workloads[w].make (&frame, n);
+
+	    start = now_us ();
+	    for (i = 0; i < frame.n_ops; ++i)
+	    {
+		dfps_damage_add_box (&damage,
+				     frame.ops[i].x1, frame.ops[i].y1,
+				     frame.ops[i].x2, frame.ops[i].y2);
+	    }
+	    dfps_damage_cluster (&damage);
+	    elapsed += now_us () - start;
+
+	    ops += frame.n_ops;
+	    exact += exact_area (frame.ops, frame.n_ops);
+	    bbox += bbox_area (frame.ops, frame.n_ops);
+	    boxes += damage.n_boxes;
+	    uploaded += exact_area (damage.boxes, damage.n_boxes);
+
+	    damage.n_boxes = 0;
+	}
+
+	printf ("%-10s %6.1f %10.0f %10.0f %6.1f %10.0f %10.0f %8.2f\n",
+		workloads[w].name, ops / n_frames,
+		(double)damage.damaged_pixels / n_frames, exact / n_frames,
+		boxes / n_frames, uploaded / n_frames, bbox / n_frames,
+		elapsed / n_frames);
+    }
+
+    return 0;
+}
@@ -0,0 +1,347 @@
+/*
+ * Copyright 2010 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Image chunk size benchmark
+ *
+ * Creates images of various shapes with qxl_image_create() in an mspace
+ * heap, like the device memory, that is first fragmented with allocations
+ * of random sizes, up to 64KiB by default. A number of images are kept
+ * alive, like commands that the device hasn't released yet. When an
+ * allocation fails, the oldest image is destroyed and the allocation
+ * retried, which stands for an OOM stall in the driver.
+ *
+ * For each shape and chunk size setting, prints the time per image, the
+ * number of chunks per image and the number of stalls. If a chunk doesn't
+ * fit in the heap even with no image alive, which would make the driver
+ * loop in its OOM handling, that is reported instead.
+ *
+ *     image-chunks [heap MiB [images in flight [largest fragment KiB]]]
+ *
+ * A largest fragment size of 0 leaves the heap unfragmented.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "qxl.h"
+#include "qxl_mem.h"
+
+/* Buffer objects are a header followed by their data in the heap */
+typedef struct
+{
+    size_t	size;
+    int		refcount;
+    int		pad;
+} bench_bo_t;
+
+static struct qxl_mem heap;
+static qxl_screen_t bench_qxl;
+
+static struct qxl_bo **in_flight;
+static int n_in_flight;
+static int max_in_flight;
+
+static unsigned long n_chunks;
+static unsigned long n_stalls;
+
+/* Where to go when an allocation can't be satisfied at all */
+static jmp_buf out_of_memory;
+
+struct qxl_bo *
+qxl_ums_lookup_phy_addr (qxl_screen_t *qxl, uint64_t phy_addr)
+{
+    return (struct qxl_bo *)((bench_bo_t *)(uintptr_t)phy_addr - 1);
+}
+
+/* qxl_image_create() doesn't use the upload worker */
+qxl_upload_job_t *
+qxl_upload_job_new (pixman_image_t *source, int Bpp, int width)
+{
+    return NULL;
+}
+
+Bool
+qxl_upload_job_add_rows (qxl_upload_job_t *job,
+			 const uint8_t *src, int src_stride,
+			 uint8_t *dest, int dest_stride, int n_rows)
+{
+    return FALSE;
+}
+
+void
+qxl_upload_job_set_id (qxl_upload_job_t *job, uint64_t *id)
+{
+}
+
+uint32_t
+qxl_upload_job_submit (qxl_screen_t *qxl, qxl_upload_job_t *job)
+{
+    return 0;
+}
+
+static void
+release_oldest (void)
+{
+    struct qxl_bo *image_bo = in_flight[0];
+
+    memmove (in_flight, in_flight + 1, --n_in_flight * sizeof *in_flight);
+    qxl_image_destroy (&bench_qxl, image_bo);
+}
+
+static struct qxl_bo *
+bench_bo_alloc (qxl_screen_t *qxl, unsigned long size, const char *name)
+{
+    bench_bo_t *bo;
+
+    while (!(bo = mspace_malloc (heap.space, sizeof *bo + size)))
+    {
+	if (!n_in_flight)
+	    longjmp (out_of_memory, 1);
+
+	n_stalls++;
+	heap.stats_age = 0;
+	release_oldest ();
+    }
+
+    if (strcmp (name, "image data") == 0)
+	n_chunks++;
+
+    bo->size = size;
+    bo->refcount = 1;
+
+    return (struct qxl_bo *)bo;
+}
+
+static void *
+bench_bo_map (struct qxl_bo *_bo)
+{
+    bench_bo_t *bo = (bench_bo_t *)_bo;
+
+    return bo + 1;
+}
+
+static void
+bench_bo_unmap (struct qxl_bo *_bo)
+{
+}
+
+static void
+bench_bo_incref (qxl_screen_t *qxl, struct qxl_bo *_bo)
+{
+    bench_bo_t *bo = (bench_bo_t *)_bo;
+
+    bo->refcount++;
+}
+
+static void
+bench_bo_decref (qxl_screen_t *qxl, struct qxl_bo *_bo)
+{
+    bench_bo_t *bo = (bench_bo_t *)_bo;
+
+    if (--bo->refcount == 0)
+	mspace_free (heap.space, bo);
+}
+
+/* Physical addresses are virtual addresses here, as for Xspice */
+static void
+bench_bo_output_bo_reloc (qxl_screen_t *qxl, uint32_t dst_offset,
+			  struct qxl_bo *_dst_bo, struct qxl_bo *_src_bo)
+{
+    bench_bo_t *dst_bo = (bench_bo_t *)_dst_bo;
+    bench_bo_t *src_bo = (bench_bo_t *)_src_bo;
+    uint64_t value = (uintptr_t)(src_bo + 1);
+
+    /* The QXL structures are packed */
+    memcpy ((uint8_t *)(dst_bo + 1) + dst_offset, &value, sizeof value);
+    src_bo->refcount++;
+}
+
+static struct qxl_bo_funcs bench_bo_funcs =
+{
+    .bo_alloc = bench_bo_alloc,
+    .bo_map = bench_bo_map,
+    .bo_unmap = bench_bo_unmap,
+    .bo_incref = bench_bo_incref,
+    .bo_decref = bench_bo_decref,
+    .bo_output_bo_reloc = bench_bo_output_bo_reloc,
+};
+
+/* Leave the heap with holes of random sizes, a quarter of it in use */
+static void
+fragment_heap (size_t heap_size, int max_fragment)
+{
+    void **blocks = calloc (heap_size / 1024, sizeof (void *));
+    int n_blocks = 0;
+    int i;
+
+    srand (1);
+
+    while (max_fragment && n_blocks < heap_size / 1024)
+    {
+	void *p = mspace_malloc (heap.space, 256 + rand () % max_fragment);
+
+	if (!p)
+	    break;
+	blocks[n_blocks++] = p;
+    }
+
+    for (i = 0; i < n_blocks; ++i)
+    {
+	if (rand () % 4)
+	    mspace_free (heap.space, blocks[i]);
+    }
+
+    free (blocks);
+}
+
+static double
+now_us (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static const struct
+{
+    int width, height;
+} shapes[] =
+{
+    { 64, 64 },
+    { 256, 256 },
+    { 512, 512 },
+    { 1024, 768 },
+    { 1920, 32 },
+    { 32, 1080 },
+    { 1920, 1080 },
+    { 3840, 2160 },
+};
+
+static const struct
+{
+    const char *name;
+    int min, max;
+} settings[] =
+{
+    { "fixed 256K", 256 * 1024, 256 * 1024 },
+    { "fixed 1M", 1024 * 1024, 1024 * 1024 },
+    { "adaptive", 16 * 1024, 1024 * 1024 },
+};
+
+#define N_SHAPES (sizeof (shapes) / sizeof (shapes[0]))
+#define N_SETTINGS (sizeof (settings) / sizeof (settings[0]))
+
+int
+main (int argc, char **argv)
+{
+    size_t heap_size = (argc > 1 ? atoi (argv[1]) : 64) << 20;
+    void *heap_base;
+    qxl_memslot_t slot;
+    uint8_t *pixels;
+    int max_fragment;
+    int s, c;
+
+    max_in_flight = argc > 2 ? atoi (argv[2]) : 32;
+    max_fragment = (argc > 3 ? atoi (argv[3]) : 64) * 1024;
+    in_flight = calloc (max_in_flight, sizeof *in_flight);
+
+    /* The largest image */
+    pixels = calloc (3840 * 2160, 4);
+
+    memset (&slot, 0, sizeof slot);
+    bench_qxl.mem_slots = &slot;
+    bench_qxl.bo_funcs = &bench_bo_funcs;
+    bench_qxl.mem = &heap;
+
+    printf ("%-12s %-12s %10s %10s %8s\n",
+	    "shape", "setting", "us/image", "chunks", "stalls");
+
+    for (s = 0; s < N_SHAPES; ++s)
+    {
+	int width = shapes[s].width;
+	int height = shapes[s].height;
+	int n_images = MAX (16, (int)((256 << 20) / ((size_t)width * height * 4)));
+
+	for (c = 0; c < N_SETTINGS; ++c)
+	{
+	    char shape[32];
+	    double start, elapsed;
+	    int i;
+
+	    heap_base = malloc (heap_size);
+	    heap.space = create_mspace_with_base (heap_base, heap_size, 0, NULL);
+	    heap.stats_age = 0;
+	    fragment_heap (heap_size, max_fragment);
+
+	    bench_qxl.image_chunk_min = settings[c].min;
+	    bench_qxl.image_chunk_max = settings[c].max;
+	    n_chunks = n_stalls = 0;
+
+	    snprintf (shape, sizeof shape, "%dx%d", width, height);
+
+	    if (setjmp (out_of_memory))
+	    {
+		printf ("%-12s %-12s %10s\n", shape, settings[c].name,
+			"no fit");
+		free (heap_base);
+		continue;
+	    }
+
+	    start = now_us ();
+	    for (i = 0; i < n_images; ++i)
+	    {
+		struct qxl_bo *image_bo;
+
+		if (n_in_flight == max_in_flight)
+		    release_oldest ();
+
+		/* This may release images to make room */
+		image_bo = qxl_image_create (
+		    &bench_qxl, pixels, 0, 0, width, height, width * 4, 4, TRUE);
+		in_flight[n_in_flight++] = image_bo;
+	    }
+	    while (n_in_flight)
+		release_oldest ();
+	    elapsed = now_us () - start;
+
+	    printf ("%-12s %-12s %10.1f %10.1f %8lu\n",
+		    shape, settings[c].name, elapsed / n_images,
+		    (double)n_chunks / n_images, n_stalls);
+
+	    free (heap_base);
+	}
+    }
+
+    free (pixels);
+    free (in_flight);
+
+    return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright 2010 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Readback benchmark
+ *
+ * Compares the throughput of qxl_readback_rows() with the pixman
+ * composite that download_box_no_update() falls back to, and with plain
+ * memcpy(), for boxes of various sizes.
+ *
+ * By default the pixels are read from ordinary memory, where all of them
+ * are about as fast. For meaningful numbers, pass a write combined
+ * mapping of the video memory of a QXL device, as root in the guest:
+ *
+ *     readback /sys/bus/pci/devices/0000:00:02.0/resource1_wc
+ *
+ * Only the first 8MiB are read, and nothing is written to them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qxl.h"
+
+#define SRC_WIDTH 1920
+#define SRC_HEIGHT 1080
+#define SRC_STRIDE (SRC_WIDTH * 4)
+#define SRC_SIZE (SRC_STRIDE * SRC_HEIGHT)
+
+static const struct
+{
+    int width, height;
+} boxes[] =
+{
+    { 64, 64 },
+    { 256, 256 },
+    { 1024, 768 },
+    { 1920, 1080 },
+};
+
+#define N_BOXES (sizeof (boxes) / sizeof (boxes[0]))
+
+enum
+{
+    COPY_COMPOSITE,
+    COPY_MEMCPY,
+    COPY_READBACK,
+    N_COPIES
+};
+
+static const char *copy_names[N_COPIES] =
+{
+    "composite", "memcpy", "readback"
+};
+
+static double
+now_s (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Bool
+copy_box (int copy, pixman_image_t *src, pixman_image_t *dest,
+	  int width, int height)
+{
+    uint8_t *s = (uint8_t *)pixman_image_get_data (src);
+    uint8_t *d = (uint8_t *)pixman_image_get_data (dest);
+    int src_stride = pixman_image_get_stride (src);
+    int dest_stride = pixman_image_get_stride (dest);
+    int y;
+
+    switch (copy)
+    {
+    case COPY_COMPOSITE:
+	pixman_image_composite (PIXMAN_OP_SRC, src, NULL, dest,
+				0, 0, 0, 0, 0, 0, width, height);
+	return TRUE;
+
+    case COPY_MEMCPY:
+	for (y = 0; y < height; ++y)
+	    memcpy (d + y * dest_stride, s + y * src_stride, width * 4);
+	return TRUE;
+
+    case COPY_READBACK:
+	return qxl_readback_rows (d, dest_stride, s, src_stride,
+				  width * 4, height);
+    }
+
+    return FALSE;
+}
+
+int
+main (int argc, char **argv)
+{
+    pixman_image_t *src, *dest;
+    void *src_bits;
+    int b, c;
+
+    if (argc > 1)
+    {
+	int fd = open (argv[1], O_RDONLY);
+
+	if (fd < 0)
+	{
+	    perror (argv[1]);
+	    return 1;
+	}
+
+	src_bits = mmap (NULL, SRC_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (src_bits == MAP_FAILED)
+	{
+	    perror ("mmap");
+	    return 1;
+	}
+    }
+    else
+    {
+	src_bits = calloc (1, SRC_SIZE);
+    }
+
+    src = pixman_image_create_bits (PIXMAN_x8r8g8b8, SRC_WIDTH, SRC_HEIGHT,
+				    src_bits, SRC_STRIDE);
+    dest = pixman_image_create_bits (PIXMAN_x8r8g8b8, SRC_WIDTH, SRC_HEIGHT,
+				     NULL, SRC_STRIDE);
+
+    printf ("%-12s", "box");
+    for (c = 0; c < N_COPIES; ++c)
+	printf (" %12s", copy_names[c]);
+    printf ("   (MB/s)\n");
+
+    for (b = 0; b < N_BOXES; ++b)
+    {
+	char name[32];
+
+	snprintf (name, sizeof name, "%dx%d", boxes[b].width, boxes[b].height);
+	printf ("%-12s", name);
+
+	for (c = 0; c < N_COPIES; ++c)
+	{
+	    double bytes = 0, start = now_s (), elapsed = 0;
+
+	    do
+	    {
+		if (!copy_box (c, src, dest, boxes[b].width, boxes[b].height))
+		    break;
+		bytes += boxes[b].width * boxes[b].height * 4;
+		elapsed = now_s () - start;
+	    } while (elapsed < 0.2);
+
+	    if (bytes)
+		printf (" %12.0f", bytes / elapsed / 1e6);
+	    else
+		printf (" %12s", "n/a");
+	}
+
+	printf ("\n");
+    }
+
+    pixman_image_unref (src);
+    pixman_image_unref (dest);
+
+    return 0;
+}
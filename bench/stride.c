@@ -0,0 +1,231 @@
+/*
+ * Copyright 2010 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Surface alignment benchmark
+ *
+ * Lays out surfaces the way the SurfaceStrideAlign and SurfaceAllocAlign
+ * options do: the surface in an mspace heap, like the video memory, with
+ * its rows aligned to the stride alignment and its start to the
+ * allocation alignment, and its host image in system memory with the
+ * same row alignment. Then measures, for each layout:
+ *
+ *  - readback: copying the surface to the host image, as
+ *    download_box_no_update() does
+ *  - upload: copying the host image rows into the heap, as the copy into
+ *    image chunks in qxl_image_create() does
+ *  - fill: software rendering of solid fills into the host image
+ *
+ * Each surface is also drawn at an odd x offset, since the boxes that are
+ * read back and uploaded rarely start on a row boundary.
+ *
+ *     stride [width height]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "qxl.h"
+#include "mspace.h"
+
+#define HEAP_SIZE (64 << 20)
+
+static const struct
+{
+    int stride_align;
+    int alloc_align;
+} layouts[] =
+{
+    { 4, 0 },
+    { 64, 0 },
+    { 64, 64 },
+    { 4, 4096 },
+    { 64, 4096 },
+};
+
+#define N_LAYOUTS (sizeof (layouts) / sizeof (layouts[0]))
+
+enum
+{
+    OP_READBACK,
+    OP_UPLOAD,
+    OP_FILL,
+    N_OPS
+};
+
+static const char *op_names[N_OPS] =
+{
+    "readback", "upload", "fill"
+};
+
+static double
+now_s (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+align (int x, int alignment)
+{
+    return (x + alignment - 1) & ~(alignment - 1);
+}
+
+static void
+free_bits (pixman_image_t *image, void *data)
+{
+    free (data);
+}
+
+/* The same as create_aligned_image() in qxl_surface_ums.c */
+static pixman_image_t *
+create_host_image (int width, int height, int alignment)
+{
+    int stride = width * 4;
+    pixman_image_t *image;
+    void *bits;
+
+    if (alignment <= 4)
+	return pixman_image_create_bits (PIXMAN_x8r8g8b8, width, height, NULL, -1);
+
+    stride = align (stride, alignment);
+
+    if (posix_memalign (&bits, alignment, (size_t)stride * height) != 0)
+	return NULL;
+
+    image = pixman_image_create_bits (PIXMAN_x8r8g8b8, width, height, bits, stride);
+    pixman_image_set_destroy_function (image, free_bits, bits);
+
+    return image;
+}
+
+static void
+run_op (int op, pixman_image_t *dev, pixman_image_t *host,
+	int x, int width, int height)
+{
+    uint8_t *d = (uint8_t *)pixman_image_get_data (dev);
+    uint8_t *h = (uint8_t *)pixman_image_get_data (host);
+    int dev_stride = pixman_image_get_stride (dev);
+    int host_stride = pixman_image_get_stride (host);
+    int y;
+
+    switch (op)
+    {
+    case OP_READBACK:
+	if (!qxl_readback_rows (h + x * 4, host_stride, d + x * 4, dev_stride,
+				width * 4, height))
+	{
+	    pixman_image_composite (PIXMAN_OP_SRC, dev, NULL, host,
+				    x, 0, 0, 0, x, 0, width, height);
+	}
+	break;
+
+    case OP_UPLOAD:
+	for (y = 0; y < height; ++y)
+	    memcpy (d + y * dev_stride + x * 4, h + y * host_stride + x * 4, width * 4);
+	break;
+
+    case OP_FILL:
+	pixman_fill ((uint32_t *)h, host_stride / 4, 32, x, 0, width, height,
+		     0xff336699);
+	break;
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+    int width = argc > 2 ? atoi (argv[1]) : 1000;
+    int height = argc > 2 ? atoi (argv[2]) : 768;
+    void *heap_base = malloc (HEAP_SIZE);
+    mspace heap = create_mspace_with_base (heap_base, HEAP_SIZE, 0, NULL);
+    int l, o, x;
+
+    /* Leave the heap top at an odd multiple of its own alignment */
+    mspace_malloc (heap, 40);
+
+    printf ("%-7s %-6s %-6s %-4s", "stride", "alloc", "addr", "x");
+    for (o = 0; o < N_OPS; ++o)
+	printf (" %10s", op_names[o]);
+    printf ("   (MB/s, %dx%d)\n", width, height);
+
+    for (l = 0; l < N_LAYOUTS; ++l)
+    {
+	int stride = align (width * 4, layouts[l].stride_align);
+	size_t size = (size_t)stride * height + stride;
+	pixman_image_t *dev, *host;
+	void *bits;
+
+	/* See surface_send_create() */
+	if (layouts[l].alloc_align)
+	    bits = mspace_memalign (heap, layouts[l].alloc_align, size);
+	else
+	    bits = mspace_malloc (heap, size);
+
+	dev = pixman_image_create_bits (PIXMAN_x8r8g8b8, width, height,
+					bits, stride);
+	host = create_host_image (width, height, layouts[l].stride_align);
+	memset (bits, 0x55, size);
+
+	for (x = 0; x <= 1; ++x)
+	{
+	    char alloc[16];
+
+	    snprintf (alloc, sizeof alloc, "%d", layouts[l].alloc_align);
+	    printf ("%-7d %-6s %-6d %-4d", layouts[l].stride_align,
+		    layouts[l].alloc_align ? alloc : "-",
+		    (int)((uintptr_t)bits % 4096), x);
+
+	    for (o = 0; o < N_OPS; ++o)
+	    {
+		double bytes = 0, start = now_s (), elapsed;
+
+		do
+		{
+		    run_op (o, dev, host, x, width - x, height);
+		    bytes += (double)(width - x) * height * 4;
+		    elapsed = now_s () - start;
+		} while (elapsed < 0.2);
+
+		printf (" %10.0f", bytes / elapsed / 1e6);
+	    }
+
+	    printf ("\n");
+	}
+
+	pixman_image_unref (dev);
+	pixman_image_unref (host);
+	mspace_free (heap, bits);
+    }
+
+    free (heap_base);
+
+    return 0;
+}
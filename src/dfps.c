@@ -43,11 +43,10 @@
 #include <xorg-server.h>
 #include "qxl.h"
 #include "dfps.h"
+#include "dfps_damage.h"
 
 typedef struct _dfps_info_t
 {
-    RegionRec   updated_region;
-
     PixmapPtr   copy_src;
     Pixel       solid_pixel;
     GCPtr       pgc;
@@ -72,6 +71,15 @@ typedef struct FrameTimer {
     OsTimerPtr xorg_timer;
     FrameTimerFunc func;
     void *opaque; // also stored in xorg_timer, but needed for timer_start
+    Bool running;
+    uint32_t interval; // current time between frames, in ms
+
+    /* Damage to the screen pixmap since the last frame */
+    dfps_damage_t damage;
+
+    /* Statistics, the damaged pixels are counted in damage */
+    unsigned long frames;
+    unsigned long long uploaded_pixels;
 } Timer;
 
 static CARD32 xorg_timer_callback(
@@ -81,6 +89,7 @@ static CARD32 xorg_timer_callback(
 {
     FrameTimer *timer = (FrameTimer*)arg;
 
+    timer->running = FALSE;
     timer->func(timer->opaque);
     return 0; // if non zero xorg does a TimerSet, we don't want that.
 }
@@ -97,37 +106,113 @@ static FrameTimer* timer_add(FrameTimerFunc func, void *opaque)
 
 static void timer_start(FrameTimer *timer, uint32_t ms)
 {
+    timer->running = TRUE;
     TimerSet(timer->xorg_timer, 0 /* flags */, ms, xorg_timer_callback, timer);
 }
 
-void dfps_start_ticker(qxl_screen_t *qxl)
+/* Frame rate
+
+   The ticker only runs while there is damage to send. A tick that finds
+   nothing to send doesn't rearm the timer, and the next damage starts it
+   again.
+
+   The time between frames adapts between SpiceDeferredFPS and
+   SpiceDeferredFPSMin. It doubles when a frame finds the rings still
+   half full from the previous ones, or covers more than a quarter of the
+   screen, so big or frequent updates get merged into fewer frames. It
+   halves again once frames are small and the rings drained.
+*/
+static uint32_t dfps_min_interval(qxl_screen_t *qxl)
 {
-    qxl->frames_timer = timer_add(dfps_ticker, qxl);
-    timer_start(qxl->frames_timer, 1000 / qxl->deferred_fps);
+    return 1000 / qxl->deferred_fps;
 }
 
-static void dfps_ticker(void *opaque)
+static uint32_t dfps_max_interval(qxl_screen_t *qxl)
 {
-    qxl_screen_t *qxl = (qxl_screen_t *) opaque;
-    dfps_info_t *info = NULL;
-    PixmapPtr pixmap;
+    if (qxl->deferred_fps_min == 0 || qxl->deferred_fps_min > qxl->deferred_fps)
+        return dfps_min_interval(qxl);
+    return 1000 / qxl->deferred_fps_min;
+}
 
-    pixmap = qxl->pScrn->pScreen->GetScreenPixmap(qxl->pScrn->pScreen);
-    if (pixmap)
-        info = dfps_get_info(pixmap);
-    if (info)
+static Bool ring_backlogged(struct qxl_ring *ring)
+{
+    return qxl_ring_used(ring) * 2 > qxl_ring_size(ring);
+}
+
+static void dfps_damage_add_region(dfps_damage_t *damage, RegionPtr region)
+{
+    BoxPtr boxes = RegionRects(region);
+    int n_boxes = RegionNumRects(region);
+
+    while (n_boxes--)
     {
-        qxl_surface_upload_primary_regions(qxl, pixmap, &info->updated_region);
-        RegionUninit(&info->updated_region);
-        RegionInit(&info->updated_region, NULL, 0);
+        dfps_damage_add_box(damage, boxes->x1, boxes->y1, boxes->x2, boxes->y2);
+        boxes++;
     }
-    timer_start(qxl->frames_timer, 1000 / qxl->deferred_fps);
 }
 
+/* Boxes may overlap, the region has every pixel once */
+static void dfps_damage_to_region(dfps_damage_t *damage, RegionPtr region)
+{
+    RegionRec box_region;
+    int i;
 
-static Bool unaccel (void)
+    RegionInit(region, NULL, 0);
+    for (i = 0; i < damage->n_boxes; i++)
+    {
+        RegionInit(&box_region, &damage->boxes[i], 1);
+        RegionUnion(region, region, &box_region);
+        RegionUninit(&box_region);
+    }
+}
+
+static long region_area(RegionPtr region)
 {
-    return FALSE;
+    BoxPtr boxes = RegionRects(region);
+    int n_boxes = RegionNumRects(region);
+    long area = 0;
+
+    while (n_boxes--)
+    {
+        area += (long)(boxes->x2 - boxes->x1) * (boxes->y2 - boxes->y1);
+        boxes++;
+    }
+
+    return area;
+}
+
+void dfps_dump_stats(qxl_screen_t *qxl)
+{
+    FrameTimer *timer = qxl->frames_timer;
+
+    if (!timer || !timer->frames)
+        return;
+
+    ErrorF("Deferred frames: %lu frames, %llu KPixels damaged, %llu KPixels uploaded\n",
+           timer->frames, timer->damage.damaged_pixels >> 10, timer->uploaded_pixels >> 10);
+}
+
+static void dfps_adapt_interval(qxl_screen_t *qxl, PixmapPtr pixmap, dfps_damage_t *damage)
+{
+    FrameTimer *timer = qxl->frames_timer;
+    long screen_area = (long)pixmap->drawable.width * pixmap->drawable.height;
+    Bool busy;
+
+    busy = ring_backlogged(qxl->command_ring) ||
+           ring_backlogged(qxl->release_ring) ||
+           dfps_damage_area(damage) * 4 > screen_area;
+
+    if (busy)
+        timer->interval = MIN(timer->interval * 2, dfps_max_interval(qxl));
+    else
+        timer->interval = MAX(timer->interval / 2, dfps_min_interval(qxl));
+}
+
+void dfps_start_ticker(qxl_screen_t *qxl)
+{
+    qxl->frames_timer = timer_add(dfps_ticker, qxl);
+    qxl->frames_timer->interval = dfps_min_interval(qxl);
+    timer_start(qxl->frames_timer, qxl->frames_timer->interval);
 }
 
 static Bool is_main_pixmap(PixmapPtr pixmap)
@@ -138,45 +223,60 @@ static Bool is_main_pixmap(PixmapPtr pixmap)
     return FALSE;
 }
 
+/* Where damage to the screen pixmap goes, if the ticker is running */
+static dfps_damage_t *dfps_screen_damage(PixmapPtr pixmap)
+{
+    ScrnInfoPtr scrn = xf86ScreenToScrn(pixmap->drawable.pScreen);
+    qxl_screen_t *qxl = scrn->driverPrivate;
 
-/* Establish a maximum number of disparate regions we'll track before we just
-   treat the entire bounding rectangle as having changed.
-
-   The number 20 seemed intuitive, and also produced the best results in
-   benchmarking x11perf -circle10 -repeat 1
-*/
-#define DFPS_MAX_UPDATE_REGIONS 20
-static void dfps_update_box(RegionPtr dest, int x_1, int x_2, int y_1, int y_2);
+    if (!is_main_pixmap(pixmap) || !qxl->frames_timer)
+        return NULL;
+    return &qxl->frames_timer->damage;
+}
 
-static void dfps_update_region(RegionPtr dest, RegionPtr src)
+/* Called whenever the screen pixmap gets damaged */
+static void dfps_wake_ticker(PixmapPtr pixmap)
 {
-    Bool throwaway_bool;
+    ScrnInfoPtr scrn = xf86ScreenToScrn(pixmap->drawable.pScreen);
+    qxl_screen_t *qxl = scrn->driverPrivate;
 
-    RegionAppend(dest, src);
-    RegionValidate(dest, &throwaway_bool);
-    if (RegionNumRects(dest) > DFPS_MAX_UPDATE_REGIONS)
-    {
-        struct pixman_box16 box = * (RegionExtents(dest));
-        RegionUninit(dest);
-        RegionInit(dest, NULL, 0);
-        dfps_update_box(dest, box.x1, box.x2, box.y1, box.y2);
-    }
+    if (qxl->frames_timer && !qxl->frames_timer->running)
+        timer_start(qxl->frames_timer, qxl->frames_timer->interval);
 }
 
-static void dfps_update_box(RegionPtr dest, int x_1, int x_2, int y_1, int y_2)
+static void dfps_ticker(void *opaque)
 {
-    struct pixman_box16 box;
-    RegionPtr region;
+    qxl_screen_t *qxl = (qxl_screen_t *) opaque;
+    FrameTimer *timer = qxl->frames_timer;
+    dfps_damage_t *damage = &timer->damage;
+    PixmapPtr pixmap;
+    RegionRec updated_region;
+
+    pixmap = qxl->pScrn->pScreen->GetScreenPixmap(qxl->pScrn->pScreen);
+    if (!pixmap || !dfps_get_info(pixmap) || damage->n_boxes == 0)
+        return;
+
+    dfps_adapt_interval(qxl, pixmap, damage);
+
+    dfps_damage_cluster(damage);
+    dfps_damage_to_region(damage, &updated_region);
+    damage->n_boxes = 0;
 
-    box.x1 = x_1; box.x2 = x_2; box.y1 = y_1; box.y2 = y_2;
-    region = RegionCreate(&box, 1);
+    qxl_surface_upload_primary_regions(qxl, pixmap, &updated_region);
+    timer->uploaded_pixels += region_area(&updated_region);
+    timer->frames++;
+    RegionUninit(&updated_region);
+
+    timer_start(timer, timer->interval);
+}
 
-    dfps_update_region(dest, region);
 
-    RegionUninit(region);
-    RegionDestroy(region);
+static Bool unaccel (void)
+{
+    return FALSE;
 }
 
+
 static Bool dfps_prepare_solid (PixmapPtr pixmap, int alu, Pixel planemask, Pixel fg)
 {
     dfps_info_t *info;
@@ -202,6 +302,7 @@ static Bool dfps_prepare_solid (PixmapPtr pixmap, int alu, Pixel planemask, Pixe
 static void dfps_solid (PixmapPtr pixmap, int x_1, int y_1, int x_2, int y_2)
 {
     dfps_info_t *info;
+    dfps_damage_t *damage;
 
     if (!(info = dfps_get_info (pixmap)))
         return;
@@ -210,8 +311,11 @@ static void dfps_solid (PixmapPtr pixmap, int x_1, int y_1, int x_2, int y_2)
     fbFill(&pixmap->drawable, info->pgc, x_1, y_1, x_2 - x_1, y_2 - y_1);
 
     /* Track the updated region */
-    if (is_main_pixmap(pixmap))
-        dfps_update_box(&info->updated_region, x_1, x_2, y_1, y_2);
+    if ((damage = dfps_screen_damage(pixmap)))
+    {
+        dfps_damage_add_box(damage, x_1, y_1, x_2, y_2);
+        dfps_wake_ticker(pixmap);
+    }
     return;
 }
 
@@ -255,6 +359,7 @@ static void dfps_copy (PixmapPtr dest,
           int width, int height)
 {
     dfps_info_t *info;
+    dfps_damage_t *damage;
 
     if (!(info = dfps_get_info (dest)))
         return;
@@ -263,8 +368,11 @@ static void dfps_copy (PixmapPtr dest,
     fbCopyArea(&info->copy_src->drawable, &dest->drawable, info->pgc, src_x1, src_y1, width, height, dest_x1, dest_y1);
 
     /* Update the tracking region */
-    if (is_main_pixmap(dest))
-        dfps_update_box(&info->updated_region, dest_x1, dest_x1 + width, dest_y1, dest_y1 + height);
+    if ((damage = dfps_screen_damage(dest)))
+    {
+        dfps_damage_add_box(damage, dest_x1, dest_y1, dest_x1 + width, dest_y1 + height);
+        dfps_wake_ticker(dest);
+    }
 }
 
 static void dfps_done_copy (PixmapPtr dest)
@@ -281,16 +389,19 @@ static void dfps_done_copy (PixmapPtr dest)
 static Bool dfps_put_image (PixmapPtr dest, int x, int y, int w, int h,
                char *src, int src_pitch)
 {
-    dfps_info_t *info;
+    dfps_damage_t *damage;
     FbBits *dst;
     FbStride dst_stride;
     int dst_bpp;
 
-    if (!(info = dfps_get_info (dest)))
+    if (!dfps_get_info (dest))
         return FALSE;
 
-    if (is_main_pixmap(dest))
-        dfps_update_box(&info->updated_region, x, x + w, y, y + h);
+    if ((damage = dfps_screen_damage(dest)))
+    {
+        dfps_damage_add_box(damage, x, y, x + w, y + h);
+        dfps_wake_ticker(dest);
+    }
 
     fbPrepareAccess(dest);
     fbGetPixmapBitsData(dest, dst, dst_stride, dst_bpp);
@@ -307,13 +418,16 @@ static Bool dfps_prepare_access (PixmapPtr pixmap, RegionPtr region, uxa_access_
     fbPrepareAccess(pixmap);
     if (requested_access == UXA_ACCESS_RW)
     {
-        dfps_info_t *info;
+        dfps_damage_t *damage;
 
-        if (!(info = dfps_get_info (pixmap)))
+        if (!dfps_get_info (pixmap))
             return FALSE;
 
-        if (is_main_pixmap(pixmap))
-            dfps_update_region(&info->updated_region, region);
+        if ((damage = dfps_screen_damage(pixmap)))
+        {
+            dfps_damage_add_region(damage, region);
+            dfps_wake_ticker(pixmap);
+        }
     }
     return TRUE;
 }
@@ -330,7 +444,14 @@ static Bool dfps_pixmap_is_offscreen (PixmapPtr pixmap)
 
 static void dfps_set_screen_pixmap (PixmapPtr pixmap)
 {
+    ScrnInfoPtr scrn = xf86ScreenToScrn(pixmap->drawable.pScreen);
+    qxl_screen_t *qxl = scrn->driverPrivate;
+
     pixmap->drawable.pScreen->devPrivate = pixmap;
+
+    /* The damage was to the previous screen pixmap */
+    if (qxl->frames_timer)
+        qxl->frames_timer->damage.n_boxes = 0;
 }
 
 static void dfps_clear_pixmap(PixmapPtr pixmap, int w, int h)
@@ -352,7 +473,6 @@ static PixmapPtr dfps_create_pixmap (ScreenPtr screen, int w, int h, int depth,
     info = calloc(1, sizeof(*info));
     if (!info)
         return FALSE;
-    RegionInit(&info->updated_region, NULL, 0);
 
     pixmap = fbCreatePixmap (screen, w, h, depth, usage);
     if (pixmap)
@@ -23,4 +23,5 @@
  */
 
 void dfps_start_ticker(qxl_screen_t *qxl);
+void dfps_dump_stats(qxl_screen_t *qxl);
 void dfps_set_uxa_functions(qxl_screen_t *qxl, ScreenPtr screen);
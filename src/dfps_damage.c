@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2012 CodeWeavers, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* The boxes that the deferred frames mode keeps the damage to the screen
+   pixmap in, see dfps.c. This only deals with boxes, not regions, so it
+   is also built into bench/dfps-damage.
+*/
+
+#include <xorg-server.h>
+#include "qxl.h"
+#include "dfps_damage.h"
+
+static long box_area(const BoxRec *box)
+{
+    return (long)(box->x2 - box->x1) * (box->y2 - box->y1);
+}
+
+long dfps_damage_area(dfps_damage_t *damage)
+{
+    long area = 0;
+    int i;
+
+    for (i = 0; i < damage->n_boxes; i++)
+        area += box_area(&damage->boxes[i]);
+
+    return area;
+}
+
+static Bool box_contains(const BoxRec *outer, const BoxRec *inner)
+{
+    return outer->x1 <= inner->x1 && outer->y1 <= inner->y1 &&
+           outer->x2 >= inner->x2 && outer->y2 >= inner->y2;
+}
+
+static void box_union(BoxRec *dest, const BoxRec *box)
+{
+    dest->x1 = MIN(dest->x1, box->x1);
+    dest->y1 = MIN(dest->y1, box->y1);
+    dest->x2 = MAX(dest->x2, box->x2);
+    dest->y2 = MAX(dest->y2, box->y2);
+}
+
+static long box_intersect_area(const BoxRec *a, const BoxRec *b)
+{
+    int w = MIN(a->x2, b->x2) - MAX(a->x1, b->x1);
+    int h = MIN(a->y2, b->y2) - MAX(a->y1, b->y1);
+
+    if (w <= 0 || h <= 0)
+        return 0;
+    return (long)w * h;
+}
+
+/* Area covered by the bounding box of a and b but by neither of them */
+static long merge_waste(const BoxRec *a, const BoxRec *b)
+{
+    BoxRec u = *a;
+
+    box_union(&u, b);
+    return box_area(&u) - box_area(a) - box_area(b) + box_intersect_area(a, b);
+}
+
+void dfps_damage_add_box(dfps_damage_t *damage, int x_1, int y_1, int x_2, int y_2)
+{
+    BoxRec box;
+    long best_waste;
+    int i, best;
+
+    if (x_1 >= x_2 || y_1 >= y_2)
+        return;
+
+    box.x1 = x_1; box.y1 = y_1; box.x2 = x_2; box.y2 = y_2;
+    damage->damaged_pixels += box_area(&box);
+
+    for (i = 0; i < damage->n_boxes; )
+    {
+        if (box_contains(&damage->boxes[i], &box))
+            return;
+
+        if (box_contains(&box, &damage->boxes[i]))
+            damage->boxes[i] = damage->boxes[--damage->n_boxes];
+        else
+            i++;
+    }
+
+    if (damage->n_boxes < DFPS_MAX_DAMAGE_BOXES)
+    {
+        damage->boxes[damage->n_boxes++] = box;
+        return;
+    }
+
+    best = 0;
+    best_waste = merge_waste(&damage->boxes[0], &box);
+    for (i = 1; i < damage->n_boxes; i++)
+    {
+        long waste = merge_waste(&damage->boxes[i], &box);
+
+        if (waste < best_waste)
+        {
+            best = i;
+            best_waste = waste;
+        }
+    }
+
+    box_union(&damage->boxes[best], &box);
+}
+
+/* Before a frame is sent, its boxes are clustered. Every box costs a
+   drawable and an image on top of its pixels, so two boxes are merged
+   whenever their bounding box wastes less than DFPS_BOX_COST pixels.
+   Merging then goes on, cheapest pair first, until there are no more
+   than DFPS_MAX_UPLOAD_BOXES boxes. Far apart boxes are thus only
+   merged when there are too many of them.
+*/
+#define DFPS_MAX_UPLOAD_BOXES 16
+#define DFPS_BOX_COST (64 * 64)
+
+void dfps_damage_cluster(dfps_damage_t *damage)
+{
+    BoxRec *boxes = damage->boxes;
+
+    while (damage->n_boxes > 1)
+    {
+        long best_waste = -1;
+        int i, j, best_i = 0, best_j = 1;
+
+        for (i = 0; i < damage->n_boxes; i++)
+        {
+            for (j = i + 1; j < damage->n_boxes; j++)
+            {
+                long waste = merge_waste(&boxes[i], &boxes[j]);
+
+                if (best_waste < 0 || waste < best_waste)
+                {
+                    best_waste = waste;
+                    best_i = i;
+                    best_j = j;
+                }
+            }
+        }
+
+        if (best_waste >= DFPS_BOX_COST &&
+            damage->n_boxes <= DFPS_MAX_UPLOAD_BOXES)
+            break;
+
+        box_union(&boxes[best_i], &boxes[best_j]);
+        boxes[best_j] = boxes[--damage->n_boxes];
+    }
+}
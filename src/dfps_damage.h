@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2012 CodeWeavers, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef DFPS_DAMAGE_H
+#define DFPS_DAMAGE_H
+
+/* Damage to the screen pixmap is kept in a fixed set of boxes, so
+   tracking it never allocates. A box inside another one is dropped, and
+   boxes inside a new one are replaced by it. When the set is full, the
+   new box is merged with the one that wastes the least area, so distant
+   updates, like a clock and a cursor at opposite corners, don't end up
+   as one box covering the whole screen.
+*/
+#define DFPS_MAX_DAMAGE_BOXES 32
+
+typedef struct
+{
+    BoxRec      boxes[DFPS_MAX_DAMAGE_BOXES];
+    int         n_boxes;
+
+    /* Area of every box added so far, overlaps included */
+    unsigned long long damaged_pixels;
+} dfps_damage_t;
+
+long dfps_damage_area(dfps_damage_t *damage);
+void dfps_damage_add_box(dfps_damage_t *damage, int x_1, int y_1, int x_2, int y_2);
+void dfps_damage_cluster(dfps_damage_t *damage);
+
+#endif
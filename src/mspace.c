@@ -2450,6 +2450,44 @@ struct mallinfo mspace_mallinfo(mspace msp) {
   }
   return internal_mallinfo(ms);
 }
+
+static void add_free_chunk(size_t sz, size_t *usable) {
+  int k;
+  for (k = 0; k < MSPACE_FREE_ORDERS; ++k)
+    usable[k] += (sz >> k) << k;
+}
+
+void mspace_free_info(mspace msp, size_t *free_bytes, size_t *usable) {
+  mstate m = (mstate)msp;
+  size_t mfree = 0;
+  memset(usable, 0, MSPACE_FREE_ORDERS * sizeof(size_t));
+  if (!ok_magic(m)) {
+    USAGE_ERROR_ACTION(m,m);
+  }
+  if (!PREACTION(m)) {
+    check_malloc_state(m);
+    if (is_initialized(m)) {
+      msegmentptr s = &m->seg;
+      mfree = m->topsize;
+      add_free_chunk(m->topsize, usable);
+      while (s != 0) {
+        mchunkptr q = align_as_chunk(s->base);
+        while (segment_holds(s, q) &&
+               q != m->top && q->head != FENCEPOST_HEAD) {
+          size_t sz = chunksize(q);
+          if (!cinuse(q)) {
+            mfree += sz;
+            add_free_chunk(sz, usable);
+          }
+          q = next_chunk(q);
+        }
+        s = s->next;
+      }
+    }
+    POSTACTION(m);
+  }
+  *free_bytes = mfree;
+}
 #endif /* NO_MALLINFO */
 
 int mspace_mallopt(int param_number, int value) {
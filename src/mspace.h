@@ -127,6 +127,15 @@ size_t mspace_max_footprint(mspace msp);
   the given space.
 */
 struct mallinfo mspace_mallinfo(mspace msp);
+
+/*
+  mspace_free_info returns the total number of free bytes, as in
+  mspace_mallinfo, and how they are spread: usable[k], for k below
+  MSPACE_FREE_ORDERS, is how many of them could be handed out in blocks
+  of (1 << k) bytes, not counting chunk overhead.
+*/
+#define MSPACE_FREE_ORDERS 32
+void mspace_free_info(mspace msp, size_t *free_bytes, size_t *usable);
 #endif /* NO_MALLINFO */
 
 /*
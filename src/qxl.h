@@ -98,6 +98,10 @@ struct qxl_ring_header {
 
 #pragma pack(pop)
 typedef struct surface_cache_t surface_cache_t;
+typedef struct qxl_spilled_pixmap qxl_spilled_pixmap_t;
+typedef struct qxl_packed_image qxl_packed_image_t;
+typedef struct qxl_tiled_pixmap qxl_tiled_pixmap_t;
+typedef struct qxl_placement_rule qxl_placement_rule_t;
 
 typedef struct _qxl_screen_t qxl_screen_t;
 
@@ -124,6 +128,19 @@ enum {
     OPTION_DEBUG_RENDER_FALLBACKS,
     OPTION_NUM_HEADS,
     OPTION_SPICE_DEFERRED_FPS,
+    OPTION_SPICE_DEFERRED_FPS_MIN,
+    OPTION_ASYNC_UPLOADS,
+    OPTION_IMAGE_CHUNK_MIN_SIZE,
+    OPTION_IMAGE_CHUNK_MAX_SIZE,
+    OPTION_SURFACE_CACHE_FIT_RATIO,
+    OPTION_HOST_IMAGE_IDLE_TIMEOUT,
+    OPTION_TRACK_FALLBACK_WRITES,
+    OPTION_SPILL_IDLE_SURFACES,
+    OPTION_TILED_PIXMAPS,
+    OPTION_PIXMAP_PLACEMENT,
+    OPTION_MIGRATE_PIXMAPS,
+    OPTION_SURFACE_STRIDE_ALIGN,
+    OPTION_SURFACE_ALLOC_ALIGN,
 #ifdef XSPICE
     OPTION_SPICE_PORT,
     OPTION_SPICE_TLS_PORT,
@@ -159,6 +176,7 @@ enum {
     OPTION_COMMAND_BUFFER_SIZE,
     OPTION_SPICE_SMARTCARD_FILE,
     OPTION_SPICE_VIDEO_CODECS,
+    OPTION_SPICE_ZERO_COPY_IMAGES,
 #endif
     OPTION_COUNT,
 };
@@ -205,6 +223,7 @@ void qxl_kms_setup_funcs(qxl_screen_t *qxl);
 /* ums specific functions */
 struct qxl_bo *qxl_ums_surf_mem_alloc(qxl_screen_t *qxl, uint32_t size);
 struct qxl_bo *qxl_ums_lookup_phy_addr(qxl_screen_t *qxl, uint64_t phy_addr);
+void qxl_ums_submit_command(qxl_screen_t *qxl, uint32_t cmd_type, struct qxl_bo *bo);
 
 typedef struct FrameTimer FrameTimer;
 typedef void (*FrameTimerFunc)(void *opaque);
@@ -221,6 +240,30 @@ struct qxl_cmd_stream {
 };
 #endif
 
+/* Pixmaps are grouped by their CreatePixmap usage hint for the
+ * placement policy and its statistics
+ */
+enum
+{
+    QXL_USAGE_NORMAL,
+    QXL_USAGE_SCRATCH,
+    QXL_USAGE_BACKING,
+    QXL_USAGE_GLYPH,
+    QXL_USAGE_SHARED,
+    QXL_USAGE_OTHER,
+
+    QXL_N_USAGE_CLASSES
+};
+
+typedef struct
+{
+    unsigned long	on_device;	/* got a surface */
+    unsigned long	on_host;	/* kept in system memory by the policy */
+    unsigned long	failed;		/* no surface could be allocated */
+    unsigned long	accelerated;	/* operations done by the device */
+    unsigned long	fallbacks;	/* software accesses */
+} qxl_placement_stats_t;
+
 struct _qxl_screen_t
 {
     /* These are the names QXL uses */
@@ -319,6 +362,31 @@ struct _qxl_screen_t
     int				enable_fallback_cache;
     int				enable_surfaces;
     int                         debug_render_fallbacks;
+    int				enable_async_uploads;
+    int				image_chunk_min;
+    int				image_chunk_max;
+    int				surface_cache_fit_ratio;
+    int				host_image_idle_timeout;
+    int				track_writes;
+    int				spill_surfaces;
+    int				tiled_pixmaps;
+    int				migrate_pixmaps;
+    int				surface_stride_align;
+    int				surface_alloc_align;
+
+    /* Drawing commands dropped because they repeated the previous one */
+    unsigned long		repeated_fills;
+    unsigned long		repeated_copies;
+
+    /* All tiled pixmaps, see qxl_tiled.c */
+    qxl_tiled_pixmap_t *	tiled_list;
+
+    /* Where new pixmaps go, see qxl_placement.c */
+    qxl_placement_rule_t *	placement_rules;
+    int				n_placement_rules;
+    qxl_placement_stats_t	placement_stats[QXL_N_USAGE_CLASSES];
+
+    struct qxl_upload_worker *	upload_worker;
     
     FrameTimer *        frames_timer;
 
@@ -354,9 +422,18 @@ struct _qxl_screen_t
     char playback_fifo_dir[PATH_MAX];
     void *playback_opaque;
     char smartcard_file[PATH_MAX];
+
+    /* Let image commands point straight at host image rows */
+    int                 zero_copy_images;
+    /* Host images that direct image commands still point at, hashed
+     * by address
+     */
+#define DIRECT_PIN_HASH_BITS 8
+    struct qxl_direct_pin *direct_pins[1 << DIRECT_PIN_HASH_BITS];
 #endif /* XSPICE */
 
     uint32_t deferred_fps;
+    uint32_t deferred_fps_min;
     xorg_list_t ums_bos;
     struct qxl_bo_funcs *bo_funcs;
 
@@ -440,6 +517,8 @@ void              qxl_ring_request_notify (struct qxl_ring *ring);
 
 int               qxl_ring_prod        (struct qxl_ring        *ring);
 int               qxl_ring_cons        (struct qxl_ring        *ring);
+int               qxl_ring_used        (struct qxl_ring        *ring);
+int               qxl_ring_size        (struct qxl_ring        *ring);
 
 /*
  * Surface
@@ -458,6 +537,19 @@ void *
 qxl_surface_cache_evacuate_all (surface_cache_t *qxl);
 void
 qxl_surface_cache_replace_all (surface_cache_t *qxl, void *data);
+void
+qxl_surface_cache_dump_stats (surface_cache_t *cache);
+void
+qxl_surface_cache_fini (surface_cache_t *cache);
+Bool
+qxl_surface_ensure_host_image (qxl_surface_t *surface);
+Bool
+qxl_surface_spilled_use (surface_cache_t *cache, qxl_spilled_pixmap_t *spilled);
+void
+qxl_surface_spilled_destroy (surface_cache_t *cache, PixmapPtr pixmap);
+void
+qxl_surface_spilled_adopt (surface_cache_t *cache, PixmapPtr pixmap,
+			   pixman_image_t *image, int bpp);
 
 void		    qxl_surface_set_pixmap (qxl_surface_t *surface,
 					    PixmapPtr      pixmap);
@@ -470,6 +562,7 @@ void		    qxl_surface_recycle (surface_cache_t *cache, uint32_t id);
 
 /* send anything pending to the other side */
 void		    qxl_surface_flush (qxl_surface_t *surface);
+void		    qxl_surface_dump_stats (qxl_screen_t *qxl);
 
 /* access */
 Bool		    qxl_surface_prepare_access (qxl_surface_t *surface,
@@ -478,6 +571,10 @@ Bool		    qxl_surface_prepare_access (qxl_surface_t *surface,
 						uxa_access_t   access);
 void		    qxl_surface_finish_access (qxl_surface_t *surface,
 					       PixmapPtr      pixmap);
+Bool		    qxl_surface_begin_access (qxl_surface_t *surface,
+					      RegionPtr      region,
+					      uxa_access_t   access);
+void		    qxl_surface_end_access   (qxl_surface_t *surface);
 
 /* solid */
 Bool		    qxl_surface_prepare_solid (qxl_surface_t *destination,
@@ -538,6 +635,50 @@ static inline void set_surface (PixmapPtr pixmap, qxl_surface_t *surface)
     dixSetPrivate(&pixmap->devPrivates, &uxa_pixmap_index, surface);
 }
 
+/* Pixmaps whose surface was moved to system memory, see
+ * qxl_surface_ums.c
+ */
+#if HAS_DEVPRIVATEKEYREC
+extern DevPrivateKeyRec qxl_spilled_pixmap_index;
+#else
+extern int qxl_spilled_pixmap_index;
+#endif
+
+static inline qxl_spilled_pixmap_t *get_spilled (PixmapPtr pixmap)
+{
+#if HAS_DEVPRIVATEKEYREC
+    return dixGetPrivate(&pixmap->devPrivates, &qxl_spilled_pixmap_index);
+#else
+    return dixLookupPrivate(&pixmap->devPrivates, &qxl_spilled_pixmap_index);
+#endif
+}
+
+static inline void set_spilled (PixmapPtr pixmap, qxl_spilled_pixmap_t *spilled)
+{
+    dixSetPrivate(&pixmap->devPrivates, &qxl_spilled_pixmap_index, spilled);
+}
+
+/* Pixmaps backed by a grid of surfaces, see qxl_tiled.c */
+#if HAS_DEVPRIVATEKEYREC
+extern DevPrivateKeyRec qxl_tiled_pixmap_index;
+#else
+extern int qxl_tiled_pixmap_index;
+#endif
+
+static inline qxl_tiled_pixmap_t *get_tiled (PixmapPtr pixmap)
+{
+#if HAS_DEVPRIVATEKEYREC
+    return dixGetPrivate(&pixmap->devPrivates, &qxl_tiled_pixmap_index);
+#else
+    return dixLookupPrivate(&pixmap->devPrivates, &qxl_tiled_pixmap_index);
+#endif
+}
+
+static inline void set_tiled (PixmapPtr pixmap, qxl_tiled_pixmap_t *tiled)
+{
+    dixSetPrivate(&pixmap->devPrivates, &qxl_tiled_pixmap_index, tiled);
+}
+
 static inline struct QXLRam *
 get_ram_header (qxl_screen_t *qxl)
 {
@@ -571,6 +712,162 @@ struct qxl_bo *qxl_image_create     (qxl_screen_t           *qxl,
 				       Bool		       fallback);
 void              qxl_image_destroy    (qxl_screen_t           *qxl,
 				        struct qxl_bo *bo);
+struct qxl_bo *qxl_image_create_async (qxl_screen_t         *qxl,
+				       pixman_image_t       *image,
+				       int                   x,
+				       int                   y,
+				       int                   width,
+				       int                   height,
+				       int                   Bpp,
+				       uint32_t             *seq);
+unsigned int      qxl_image_hash_and_copy (const uint8_t    *src,
+					   int               src_stride,
+					   uint8_t          *dest,
+					   int               dest_stride,
+					   int               bytes_per_pixel,
+					   int               width,
+					   int               height,
+					   uint32_t          hash);
+
+/*
+ * Upload worker
+ */
+typedef struct qxl_upload_job qxl_upload_job_t;
+
+Bool              qxl_upload_worker_init  (qxl_screen_t     *qxl);
+void              qxl_upload_worker_fini  (qxl_screen_t     *qxl);
+void              qxl_upload_worker_wait  (qxl_screen_t     *qxl,
+					   uint32_t          seq);
+void              qxl_upload_worker_sync  (qxl_screen_t     *qxl);
+Bool              qxl_upload_worker_queue_command (qxl_screen_t  *qxl,
+						   uint32_t       type,
+						   struct qxl_bo *bo);
+qxl_upload_job_t *qxl_upload_job_new      (pixman_image_t   *source,
+					   int               Bpp,
+					   int               width);
+void              qxl_upload_job_free     (qxl_upload_job_t *job);
+Bool              qxl_upload_job_add_rows (qxl_upload_job_t *job,
+					   const uint8_t    *src,
+					   int               src_stride,
+					   uint8_t          *dest,
+					   int               dest_stride,
+					   int               n_lines);
+void              qxl_upload_job_set_id   (qxl_upload_job_t *job,
+					   uint64_t         *id);
+uint32_t          qxl_upload_job_submit   (qxl_screen_t     *qxl,
+					   qxl_upload_job_t *job);
+
+/*
+ * Write tracking
+ */
+Bool              qxl_track_init          (qxl_screen_t     *qxl);
+void              qxl_track_fini          (qxl_screen_t     *qxl);
+pixman_image_t *  qxl_track_create_image  (pixman_format_code_t format,
+					   int               width,
+					   int               height);
+Bool              qxl_track_begin         (qxl_surface_t    *surface);
+Bool              qxl_track_end           (qxl_surface_t    *surface,
+					   RegionPtr         dirty);
+
+/*
+ * Readback
+ */
+Bool              qxl_readback_rows       (uint8_t          *dest,
+					   int               dest_stride,
+					   const uint8_t    *src,
+					   int               src_stride,
+					   int               width,
+					   int               height);
+
+/*
+ * Packed images
+ */
+qxl_packed_image_t *qxl_pack_image        (pixman_image_t   *image);
+void              qxl_unpack_image        (qxl_packed_image_t *packed,
+					   pixman_image_t   *dest);
+void              qxl_packed_image_get_info (qxl_packed_image_t   *packed,
+					     pixman_format_code_t *format,
+					     int                  *width,
+					     int                  *height);
+size_t            qxl_packed_image_size   (qxl_packed_image_t *packed);
+void              qxl_packed_image_free   (qxl_packed_image_t *packed);
+
+/*
+ * Tiled pixmaps
+ */
+qxl_tiled_pixmap_t *qxl_tiled_create      (qxl_screen_t     *qxl,
+					   int               width,
+					   int               height,
+					   int               bpp);
+void              qxl_tiled_set_pixmap    (qxl_tiled_pixmap_t *tiled,
+					   PixmapPtr         pixmap);
+void              qxl_tiled_destroy       (qxl_tiled_pixmap_t *tiled);
+qxl_surface_t *   qxl_tiled_stats_surface (qxl_tiled_pixmap_t *tiled);
+void              qxl_tiled_evacuate_all  (qxl_screen_t     *qxl);
+Bool              qxl_tiled_prepare_access (qxl_tiled_pixmap_t *tiled,
+					    PixmapPtr        pixmap,
+					    RegionPtr        region,
+					    uxa_access_t     access);
+void              qxl_tiled_finish_access (qxl_tiled_pixmap_t *tiled,
+					   PixmapPtr         pixmap);
+Bool              qxl_tiled_prepare_solid (qxl_tiled_pixmap_t *tiled,
+					   Pixel             fg);
+void              qxl_tiled_solid         (qxl_tiled_pixmap_t *tiled,
+					   int x1, int y1, int x2, int y2);
+Bool              qxl_tiled_prepare_copy  (PixmapPtr         source,
+					   PixmapPtr         dest,
+					   int               xdir,
+					   int               ydir);
+Bool              qxl_tiled_prepare_composite (int           op,
+					       PicturePtr    src_picture,
+					       PicturePtr    mask_picture,
+					       PicturePtr    dest_picture,
+					       PixmapPtr     src,
+					       PixmapPtr     mask,
+					       PixmapPtr     dest);
+Bool              qxl_tiled_busy          (PixmapPtr         dest);
+void              qxl_tiled_copy          (PixmapPtr         dest,
+					   int src_x1, int src_y1,
+					   int dest_x1, int dest_y1,
+					   int width, int height);
+void              qxl_tiled_composite     (PixmapPtr         dest,
+					   int src_x, int src_y,
+					   int mask_x, int mask_y,
+					   int dest_x, int dest_y,
+					   int width, int height);
+void              qxl_tiled_done          (PixmapPtr         dest);
+Bool              qxl_tiled_put_image     (qxl_tiled_pixmap_t *tiled,
+					   int x, int y, int width, int height,
+					   const char       *src,
+					   int               src_pitch);
+
+/*
+ * Pixmap placement
+ */
+void              qxl_placement_init      (qxl_screen_t     *qxl,
+					   const char       *policy);
+int               qxl_placement_class     (unsigned          usage);
+Bool              qxl_placement_on_device (qxl_screen_t     *qxl,
+					   int               width,
+					   int               height,
+					   int               depth,
+					   int               usage_class);
+void              qxl_placement_created   (qxl_surface_t    *surface,
+					   int               usage_class);
+void              qxl_placement_count     (qxl_surface_t    *surface,
+					   Bool              accelerated);
+void              qxl_placement_dump_stats (qxl_screen_t    *qxl);
+#ifdef XSPICE
+struct qxl_bo *qxl_image_create_direct (qxl_screen_t        *qxl,
+					pixman_image_t      *image,
+					int                  x,
+					int                  y,
+					int                  width,
+					int                  height,
+					int                  Bpp);
+#endif
+Bool              qxl_image_is_pinned (qxl_screen_t        *qxl,
+				       pixman_image_t      *image);
 
 /*
  * Malloc
@@ -581,6 +878,9 @@ struct qxl_mem *  qxl_mem_create       (void                   *base,
 					unsigned long           n_bytes);
 void              qxl_mem_dump_stats   (struct qxl_mem         *mem,
 					const char             *header);
+size_t            qxl_mem_usable_bytes (struct qxl_mem         *mem,
+					size_t                  block_size);
+size_t            qxl_mem_free_bytes   (struct qxl_mem         *mem);
 void              qxl_mem_free_all     (struct qxl_mem         *mem);
 int		   qxl_garbage_collect (qxl_screen_t *qxl);
 
@@ -87,6 +87,32 @@ static const OptionInfoRec DefaultOptions[] =
       "NumHeads",                 OPTV_INTEGER, { 4 }, FALSE },
     { OPTION_SPICE_DEFERRED_FPS,
       "SpiceDeferredFPS",         OPTV_INTEGER, { 0 }, FALSE},
+    { OPTION_SPICE_DEFERRED_FPS_MIN,
+      "SpiceDeferredFPSMin",      OPTV_INTEGER, { 0 }, FALSE},
+    { OPTION_ASYNC_UPLOADS,
+      "AsyncUploads",             OPTV_BOOLEAN, { 0 }, FALSE},
+    { OPTION_IMAGE_CHUNK_MIN_SIZE,
+      "ImageChunkMinSize",        OPTV_INTEGER, { 16 }, FALSE},
+    { OPTION_IMAGE_CHUNK_MAX_SIZE,
+      "ImageChunkMaxSize",        OPTV_INTEGER, { 1024 }, FALSE},
+    { OPTION_SURFACE_CACHE_FIT_RATIO,
+      "SurfaceCacheFitRatio",     OPTV_INTEGER, { 200 }, FALSE},
+    { OPTION_HOST_IMAGE_IDLE_TIMEOUT,
+      "HostImageIdleTimeout",     OPTV_INTEGER, { 10 }, FALSE},
+    { OPTION_TRACK_FALLBACK_WRITES,
+      "TrackFallbackWrites",      OPTV_BOOLEAN, { 0 }, FALSE},
+    { OPTION_SPILL_IDLE_SURFACES,
+      "SpillIdleSurfaces",        OPTV_BOOLEAN, { 0 }, FALSE},
+    { OPTION_TILED_PIXMAPS,
+      "TiledPixmaps",             OPTV_BOOLEAN, { 0 }, FALSE},
+    { OPTION_PIXMAP_PLACEMENT,
+      "PixmapPlacement",          OPTV_STRING,  { 0 }, FALSE},
+    { OPTION_MIGRATE_PIXMAPS,
+      "MigratePixmaps",           OPTV_BOOLEAN, { 0 }, FALSE},
+    { OPTION_SURFACE_STRIDE_ALIGN,
+      "SurfaceStrideAlign",       OPTV_INTEGER, { 0 }, FALSE},
+    { OPTION_SURFACE_ALLOC_ALIGN,
+      "SurfaceAllocAlign",        OPTV_INTEGER, { 0 }, FALSE},
 #ifdef XSPICE
     { OPTION_SPICE_PORT,
       "SpicePort",                OPTV_INTEGER,   {5900}, FALSE },
@@ -156,6 +182,8 @@ static const OptionInfoRec DefaultOptions[] =
       "SpiceSmartcardFile",       OPTV_STRING,    {0}, FALSE},
     { OPTION_SPICE_VIDEO_CODECS,
       "SpiceVideoCodecs",         OPTV_STRING,    {0}, FALSE},
+    { OPTION_SPICE_ZERO_COPY_IMAGES,
+      "SpiceZeroCopyImages",      OPTV_BOOLEAN,   {0}, FALSE},
 #endif
 
     { -1, NULL, OPTV_NONE, {0}, FALSE }
@@ -469,6 +497,22 @@ qxl_close_screen (CLOSE_SCREEN_ARGS_DECL)
     
     pScreen->CreateScreenResources = qxl->create_screen_resources;
     pScreen->CloseScreen = qxl->close_screen;
+
+    qxl_upload_worker_fini (qxl);
+
+    if (qxl->track_writes)
+	qxl_track_fini (qxl);
+
+    if (qxl->deferred_fps)
+	dfps_dump_stats (qxl);
+
+    if (qxl->surface_cache)
+    {
+	qxl_surface_cache_dump_stats (qxl->surface_cache);
+	qxl_placement_dump_stats (qxl);
+	qxl_surface_dump_stats (qxl);
+	qxl_surface_cache_fini (qxl->surface_cache);
+    }
     
     result = pScreen->CloseScreen (CLOSE_SCREEN_ARGS);
     
@@ -774,6 +818,21 @@ qxl_screen_init (SCREEN_INIT_ARGS_DECL)
                                          QXL_RELEASE_RING_SIZE, 0, qxl);
     
     /* xf86DPMSInit (pScreen, xf86DPMSSet, 0); */
+
+    /* In deferred fps mode nothing is uploaded through images */
+    if (qxl->enable_async_uploads && !qxl->deferred_fps)
+    {
+	if (!qxl_upload_worker_init (qxl))
+	    xf86DrvMsg (pScrn->scrnIndex, X_WARNING,
+			"Could not start upload thread, uploading synchronously\n");
+    }
+
+    if (qxl->track_writes && !qxl_track_init (qxl))
+    {
+	xf86DrvMsg (pScrn->scrnIndex, X_WARNING,
+		    "Could not install fault handler, not tracking fallback writes\n");
+	qxl->track_writes = FALSE;
+    }
     
     pScreen->SaveScreen = qxl_blank_screen;
     
@@ -986,6 +1045,7 @@ qxl_pre_init_common(ScrnInfoPtr pScrn)
 {
     int           scrnIndex = pScrn->scrnIndex;
     qxl_screen_t *qxl = pScrn->driverPrivate;
+    const char *  placement;
 
     if (!qxl_color_setup (pScrn))
 	goto out;
@@ -1005,9 +1065,63 @@ qxl_pre_init_common(ScrnInfoPtr pScrn)
         get_bool_option (qxl->options, OPTION_DEBUG_RENDER_FALLBACKS, "QXL_DEBUG_RENDER_FALLBACKS");
     qxl->num_heads =
         get_int_option (qxl->options, OPTION_NUM_HEADS, "QXL_NUM_HEADS");
+    qxl->enable_async_uploads =
+        get_bool_option (qxl->options, OPTION_ASYNC_UPLOADS, "QXL_ASYNC_UPLOADS");
+    qxl->image_chunk_min =
+        get_int_option (qxl->options, OPTION_IMAGE_CHUNK_MIN_SIZE, "QXL_IMAGE_CHUNK_MIN_SIZE") << 10;
+    qxl->image_chunk_max =
+        get_int_option (qxl->options, OPTION_IMAGE_CHUNK_MAX_SIZE, "QXL_IMAGE_CHUNK_MAX_SIZE") << 10;
+    if (qxl->image_chunk_min <= 0)
+        qxl->image_chunk_min = 1;
+    if (qxl->image_chunk_max < qxl->image_chunk_min)
+        qxl->image_chunk_max = qxl->image_chunk_min;
+    qxl->surface_cache_fit_ratio =
+        get_int_option (qxl->options, OPTION_SURFACE_CACHE_FIT_RATIO, "QXL_SURFACE_CACHE_FIT_RATIO");
+    if (qxl->surface_cache_fit_ratio < 100)
+        qxl->surface_cache_fit_ratio = 100;
+    qxl->host_image_idle_timeout =
+        get_int_option (qxl->options, OPTION_HOST_IMAGE_IDLE_TIMEOUT, "QXL_HOST_IMAGE_IDLE_TIMEOUT");
+    if (qxl->host_image_idle_timeout < 0)
+        qxl->host_image_idle_timeout = 0;
+    qxl->track_writes =
+        get_bool_option (qxl->options, OPTION_TRACK_FALLBACK_WRITES, "QXL_TRACK_FALLBACK_WRITES");
+    qxl->spill_surfaces =
+        get_bool_option (qxl->options, OPTION_SPILL_IDLE_SURFACES, "QXL_SPILL_IDLE_SURFACES");
+    qxl->tiled_pixmaps =
+        get_bool_option (qxl->options, OPTION_TILED_PIXMAPS, "QXL_TILED_PIXMAPS");
+    qxl->migrate_pixmaps =
+        get_bool_option (qxl->options, OPTION_MIGRATE_PIXMAPS, "QXL_MIGRATE_PIXMAPS");
+    qxl->surface_stride_align =
+        get_int_option (qxl->options, OPTION_SURFACE_STRIDE_ALIGN, "QXL_SURFACE_STRIDE_ALIGN");
+    if (qxl->surface_stride_align &&
+        (qxl->surface_stride_align < 4 ||
+         (qxl->surface_stride_align & (qxl->surface_stride_align - 1))))
+    {
+        xf86DrvMsg (scrnIndex, X_WARNING,
+                    "Surface stride alignment must be a power of two of at least 4\n");
+        qxl->surface_stride_align = 0;
+    }
+    qxl->surface_alloc_align =
+        get_int_option (qxl->options, OPTION_SURFACE_ALLOC_ALIGN, "QXL_SURFACE_ALLOC_ALIGN");
+    if (qxl->surface_alloc_align & (qxl->surface_alloc_align - 1))
+    {
+        xf86DrvMsg (scrnIndex, X_WARNING,
+                    "Surface allocation alignment must be a power of two\n");
+        qxl->surface_alloc_align = 0;
+    }
+    if (qxl->surface_alloc_align <= 8)
+        qxl->surface_alloc_align = 0;
+    placement =
+        get_str_option (qxl->options, OPTION_PIXMAP_PLACEMENT, "QXL_PIXMAP_PLACEMENT");
+    qxl_placement_init (qxl, placement);
 
     qxl->deferred_fps = get_int_option(qxl->options, OPTION_SPICE_DEFERRED_FPS, "XSPICE_DEFERRED_FPS");
-    if (qxl->deferred_fps > 0)
+    qxl->deferred_fps_min = get_int_option(qxl->options, OPTION_SPICE_DEFERRED_FPS_MIN, "XSPICE_DEFERRED_FPS_MIN");
+    if (qxl->deferred_fps > 0 && qxl->deferred_fps_min > 0 &&
+        qxl->deferred_fps_min < qxl->deferred_fps)
+        xf86DrvMsg(scrnIndex, X_INFO, "Deferred FPS: %d - %d\n",
+                   qxl->deferred_fps_min, qxl->deferred_fps);
+    else if (qxl->deferred_fps > 0)
         xf86DrvMsg(scrnIndex, X_INFO, "Deferred FPS: %d\n", qxl->deferred_fps);
     else
         xf86DrvMsg(scrnIndex, X_INFO, "Deferred Frames: Disabled\n");
@@ -1018,6 +1132,37 @@ qxl_pre_init_common(ScrnInfoPtr pScrn)
                 qxl->enable_image_cache ? "Enabled" : "Disabled");
     xf86DrvMsg (scrnIndex, X_INFO, "Fallback Cache: %s\n",
                 qxl->enable_fallback_cache ? "Enabled" : "Disabled");
+    xf86DrvMsg (scrnIndex, X_INFO, "Async Uploads: %s\n",
+                qxl->enable_async_uploads ? "Enabled" : "Disabled");
+    xf86DrvMsg (scrnIndex, X_INFO, "Image Chunk Size: %d - %d KB\n",
+                qxl->image_chunk_min >> 10, qxl->image_chunk_max >> 10);
+    xf86DrvMsg (scrnIndex, X_INFO, "Surface Cache Fit Ratio: %d%%\n",
+                qxl->surface_cache_fit_ratio);
+    if (qxl->host_image_idle_timeout)
+        xf86DrvMsg (scrnIndex, X_INFO, "Host Image Idle Timeout: %d s\n",
+                    qxl->host_image_idle_timeout);
+    else
+        xf86DrvMsg (scrnIndex, X_INFO, "Host Image Idle Timeout: Disabled\n");
+    xf86DrvMsg (scrnIndex, X_INFO, "Track Fallback Writes: %s\n",
+                qxl->track_writes ? "Enabled" : "Disabled");
+    xf86DrvMsg (scrnIndex, X_INFO, "Spill Idle Surfaces: %s\n",
+                qxl->spill_surfaces ? "Enabled" : "Disabled");
+    xf86DrvMsg (scrnIndex, X_INFO, "Tiled Pixmaps: %s\n",
+                qxl->tiled_pixmaps ? "Enabled" : "Disabled");
+    xf86DrvMsg (scrnIndex, X_INFO, "Pixmap Placement: %s\n",
+                qxl->n_placement_rules ? placement : "Default");
+    xf86DrvMsg (scrnIndex, X_INFO, "Migrate Pixmaps: %s\n",
+                qxl->migrate_pixmaps ? "Enabled" : "Disabled");
+    if (qxl->surface_stride_align)
+        xf86DrvMsg (scrnIndex, X_INFO, "Surface Stride Alignment: %d bytes\n",
+                    qxl->surface_stride_align);
+    else
+        xf86DrvMsg (scrnIndex, X_INFO, "Surface Stride Alignment: Default\n");
+    if (qxl->surface_alloc_align)
+        xf86DrvMsg (scrnIndex, X_INFO, "Surface Allocation Alignment: %d bytes\n",
+                    qxl->surface_alloc_align);
+    else
+        xf86DrvMsg (scrnIndex, X_INFO, "Surface Allocation Alignment: Default\n");
 
     return TRUE;
 out:
@@ -1098,6 +1243,11 @@ qxl_pre_init (ScrnInfoPtr pScrn, int flags)
     else
         qxl->smartcard_file[0] = '\0';
 
+    qxl->zero_copy_images =
+        get_bool_option (qxl->options, OPTION_SPICE_ZERO_COPY_IMAGES, "XSPICE_ZERO_COPY_IMAGES");
+    xf86DrvMsg (scrnIndex, X_INFO, "Zero Copy Images: %s\n",
+                qxl->zero_copy_images ? "Enabled" : "Disabled");
+
     qxl->surface0_size =
         get_int_option (qxl->options, OPTION_FRAME_BUFFER_SIZE, "QXL_FRAME_BUFFER_SIZE") << 20L;
     qxl->vram_size =
@@ -37,11 +37,11 @@
 #include "qxl.h"
 #include "murmurhash3.h"
 
-static unsigned int
-hash_and_copy (const uint8_t *src, int src_stride,
-	       uint8_t *dest, int dest_stride,
-	       int bytes_per_pixel, int width, int height,
-	       uint32_t hash)
+unsigned int
+qxl_image_hash_and_copy (const uint8_t *src, int src_stride,
+			 uint8_t *dest, int dest_stride,
+			 int bytes_per_pixel, int width, int height,
+			 uint32_t hash)
 {
     int i;
   
@@ -62,10 +62,49 @@ hash_and_copy (const uint8_t *src, int src_stride,
     return hash;
 }
 
-struct qxl_bo *
-qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
-		  int x, int y, int width, int height,
-		  int stride, int Bpp, Bool fallback)
+/* Pick the size of the data chunks for an image. Every chunk costs an
+ * allocation and a chunk header, but large chunks are harder to satisfy
+ * when memory is fragmented, and lead to OOM stalls. Images that fit in
+ * the maximum chunk size start out with a single chunk. The chunk size
+ * is then halved until at least half of the free device memory, and all
+ * of the image if it can fit, could be allocated in pieces of that size.
+ * Setting the minimum and maximum sizes to the same value gives a fixed
+ * chunk size.
+ */
+static int
+image_chunk_size (qxl_screen_t *qxl, int dest_stride, int height)
+{
+    size_t total = (size_t)dest_stride * height;
+    size_t chunk_size = MIN (total, (size_t)qxl->image_chunk_max);
+
+    if (qxl->mem && qxl->image_chunk_min < qxl->image_chunk_max)
+    {
+	size_t free_bytes = qxl_mem_usable_bytes (qxl->mem, 1);
+	size_t enough = free_bytes / 2;
+
+	if (total <= free_bytes)
+	    enough = MAX (enough, total);
+
+	while (chunk_size > qxl->image_chunk_min &&
+	       qxl_mem_usable_bytes (qxl->mem, chunk_size) < enough)
+	{
+	    chunk_size /= 2;
+	}
+
+	chunk_size = MAX (chunk_size, (size_t)qxl->image_chunk_min);
+    }
+
+    return MAX (chunk_size, (size_t)dest_stride);
+}
+
+/* If job is not NULL, the rows are only recorded in it, and copied and
+ * hashed later by the upload worker.
+ */
+static struct qxl_bo *
+image_create (qxl_screen_t *qxl, const uint8_t *data,
+	      int x, int y, int width, int height,
+	      int stride, int Bpp, Bool fallback,
+	      qxl_upload_job_t *job)
 {
 	uint32_t hash;
 	struct QXLImage *image;
@@ -74,6 +113,7 @@ qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 	int dest_stride = (width * Bpp + 3) & (~3);
 	int h;
 	int chunk_size;
+	Bool cacheable = TRUE;
 
 	data += y * stride + x * Bpp;
 
@@ -90,7 +130,7 @@ qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 	hash = 0;
 	h = height;
 
-	chunk_size = MAX (512 * 512, dest_stride);
+	chunk_size = image_chunk_size (qxl, dest_stride, height);
 
 #ifdef XF86DRM_MODE
 	/* ensure we will not create too many pieces and overflow
@@ -113,9 +153,22 @@ qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 
 	    QXLDataChunk *chunk = qxl->bo_funcs->bo_map(bo);
 	    chunk->data_size = n_lines * dest_stride;
-	    hash = hash_and_copy (data, stride,
-				  chunk->data, dest_stride,
-				  Bpp, width, n_lines, hash);
+	    if (job && !qxl_upload_job_add_rows (job, data, stride,
+						  chunk->data, dest_stride,
+						  n_lines))
+	    {
+		/* The hash would only cover part of the image */
+		cacheable = FALSE;
+		qxl_image_hash_and_copy (data, stride,
+					 chunk->data, dest_stride,
+					 Bpp, width, n_lines, hash);
+	    }
+	    else if (!job)
+	    {
+		hash = qxl_image_hash_and_copy (data, stride,
+						chunk->data, dest_stride,
+						Bpp, width, n_lines, hash);
+	    }
 	    
 	    if (tail_bo)
 	    {
@@ -180,11 +233,14 @@ qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 
 	qxl->bo_funcs->bo_decref(qxl, head_bo);
 	/* Add to hash table if caching is enabled */
-	if ((fallback && qxl->enable_fallback_cache)	||
-	    (!fallback && qxl->enable_image_cache))
+	if (cacheable &&
+	    ((fallback && qxl->enable_fallback_cache)	||
+	     (!fallback && qxl->enable_image_cache)))
 	{
             image->descriptor.id = hash;
             image->descriptor.flags = QXL_IMAGE_CACHE;
+	    if (job)
+		qxl_upload_job_set_id (job, &image->descriptor.id);
 #if 0
             ErrorF ("added with hash %u\n", hash);
 #endif
@@ -194,6 +250,204 @@ qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 	return image_bo;
 }
 
+struct qxl_bo *
+qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
+		  int x, int y, int width, int height,
+		  int stride, int Bpp, Bool fallback)
+{
+    return image_create (qxl, data, x, y, width, height,
+			 stride, Bpp, fallback, NULL);
+}
+
+/* Only worth the round trip through the worker for large images */
+#define ASYNC_UPLOAD_MIN_BYTES (64 * 1024)
+
+/* Like qxl_image_create() for a fallback upload from a host image, but
+ * leaves copying the pixels to the upload worker when there is one. The
+ * sequence number of the job is stored in *seq, and the image must not
+ * be written to before qxl_upload_worker_wait() has returned for it.
+ */
+struct qxl_bo *
+qxl_image_create_async (qxl_screen_t *qxl, pixman_image_t *pimage,
+			int x, int y, int width, int height, int Bpp,
+			uint32_t *seq)
+{
+    const uint8_t *data = (const uint8_t *)pixman_image_get_data (pimage);
+    int stride = pixman_image_get_stride (pimage);
+    qxl_upload_job_t *job;
+    struct qxl_bo *image_bo;
+
+    if (!qxl->upload_worker || width * height * Bpp < ASYNC_UPLOAD_MIN_BYTES ||
+	!(job = qxl_upload_job_new (pimage, Bpp, width)))
+    {
+	return qxl_image_create (qxl, data, x, y, width, height,
+				 stride, Bpp, TRUE);
+    }
+
+    image_bo = image_create (qxl, data, x, y, width, height,
+			     stride, Bpp, TRUE, job);
+
+    *seq = qxl_upload_job_submit (qxl, job);
+
+    return image_bo;
+}
+
+#ifdef XSPICE
+/* spice-server reads the pixels of a direct image whenever it gets to
+ * the command, so the host image must not be written to until the
+ * command is released. Each such image is counted here. The count has to
+ * follow the image rather than a surface, since evacuation and spilling
+ * move host images from one surface to another.
+ */
+struct qxl_direct_pin
+{
+    pixman_image_t *		image;
+    int				count;
+    struct qxl_direct_pin *	next;
+};
+
+static struct qxl_direct_pin **
+pin_bucket (qxl_screen_t *qxl, pixman_image_t *pimage)
+{
+    uint32_t key = (uintptr_t)pimage >> 4;
+
+    return &qxl->direct_pins[(key * 2654435761u) >> (32 - DIRECT_PIN_HASH_BITS)];
+}
+
+static Bool
+pin_image (qxl_screen_t *qxl, pixman_image_t *pimage)
+{
+    struct qxl_direct_pin **bucket = pin_bucket (qxl, pimage);
+    struct qxl_direct_pin *pin;
+
+    for (pin = *bucket; pin != NULL; pin = pin->next)
+    {
+	if (pin->image == pimage)
+	{
+	    pin->count++;
+	    return TRUE;
+	}
+    }
+
+    if (!(pin = malloc (sizeof *pin)))
+	return FALSE;
+
+    pin->image = pimage;
+    pin->count = 1;
+    pin->next = *bucket;
+    *bucket = pin;
+
+    return TRUE;
+}
+
+static void
+unpin_image (qxl_screen_t *qxl, pixman_image_t *pimage)
+{
+    struct qxl_direct_pin **p;
+
+    for (p = pin_bucket (qxl, pimage); *p != NULL; p = &(*p)->next)
+    {
+	struct qxl_direct_pin *pin = *p;
+
+	if (pin->image == pimage)
+	{
+	    if (--pin->count == 0)
+	    {
+		*p = pin->next;
+		free (pin);
+	    }
+	    return;
+	}
+    }
+}
+
+/* In Xspice the device memory is ordinary process memory and the memory
+ * slot spans the whole address space, so spice-server can read pixels
+ * straight from a host image. The image is referenced after the QXLImage
+ * and kept alive until qxl_image_destroy(), and it stays pinned until
+ * then, see qxl_image_is_pinned(). It is marked unstable so that it is
+ * never cached.
+ *
+ * Returns NULL if the image can't be pinned; the caller should copy the
+ * pixels instead.
+ */
+struct qxl_bo *
+qxl_image_create_direct (qxl_screen_t *qxl, pixman_image_t *pimage,
+			 int x, int y, int width, int height, int Bpp)
+{
+	struct qxl_bo *image_bo;
+	struct QXLImage *image;
+	pixman_image_t **pinned;
+	uint8_t *data = (uint8_t *)pixman_image_get_data (pimage);
+	int stride = pixman_image_get_stride (pimage);
+
+	data += y * stride + x * Bpp;
+
+	if (!pin_image (qxl, pimage))
+	    return NULL;
+
+	image_bo = qxl->bo_funcs->bo_alloc (
+	    qxl, sizeof *image + sizeof (pixman_image_t *), "direct image struct");
+	image = qxl->bo_funcs->bo_map(image_bo);
+
+	image->descriptor.id = 0;
+	image->descriptor.type = SPICE_IMAGE_TYPE_BITMAP;
+	image->descriptor.flags = 0;
+	image->descriptor.width = width;
+	image->descriptor.height = height;
+
+	if (Bpp == 2)
+	{
+	    image->bitmap.format = SPICE_BITMAP_FMT_16BIT;
+	}
+	else if (Bpp == 1)
+	{
+	    image->bitmap.format = SPICE_BITMAP_FMT_8BIT_A;
+	}
+	else if (Bpp == 4)
+	{
+	    image->bitmap.format = SPICE_BITMAP_FMT_RGBA;
+	}
+	else
+	{
+	    abort();
+	}
+
+	image->bitmap.flags =
+	    SPICE_BITMAP_FLAGS_TOP_DOWN | QXL_BITMAP_DIRECT | QXL_BITMAP_UNSTABLE;
+	image->bitmap.x = width;
+	image->bitmap.y = height;
+	image->bitmap.stride = stride;
+	image->bitmap.palette = 0;
+	image->bitmap.data = physical_address (qxl, data, qxl->main_mem_slot);
+
+	pinned = (pixman_image_t **)(image + 1);
+	*pinned = pixman_image_ref (pimage);
+
+	qxl->bo_funcs->bo_unmap(image_bo);
+	return image_bo;
+}
+#endif
+
+/* Whether a command that hasn't been released yet reads pixels straight
+ * from image. Software must not write to such an image.
+ */
+Bool
+qxl_image_is_pinned (qxl_screen_t *qxl, pixman_image_t *pimage)
+{
+#ifdef XSPICE
+    struct qxl_direct_pin *pin;
+
+    for (pin = *pin_bucket (qxl, pimage); pin != NULL; pin = pin->next)
+    {
+	if (pin->image == pimage)
+	    return TRUE;
+    }
+#endif
+
+    return FALSE;
+}
+
 void
 qxl_image_destroy (qxl_screen_t *qxl,
 		   struct qxl_bo *image_bo)
@@ -205,6 +459,19 @@ qxl_image_destroy (qxl_screen_t *qxl,
     qxl->bo_funcs->bo_unmap(image_bo);
 
     image = qxl->bo_funcs->bo_map(image_bo);
+#ifdef XSPICE
+    if (image->bitmap.flags & QXL_BITMAP_DIRECT)
+    {
+	pixman_image_t *pinned = *(pixman_image_t **)(image + 1);
+
+	unpin_image (qxl, pinned);
+	pixman_image_unref (pinned);
+
+	qxl->bo_funcs->bo_unmap(image_bo);
+	qxl->bo_funcs->bo_decref (qxl, image_bo);
+	return;
+    }
+#endif
     chunk = image->bitmap.data;
     while (chunk)
     {
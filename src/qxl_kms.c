@@ -710,6 +710,7 @@ qxl_kms_surface_create(qxl_screen_t *qxl,
     qxl->bo_funcs->bo_unmap(surface->bo);
     surface->access_type = UXA_ACCESS_RO;
     surface->bpp = bpp;
+    qxl_surface_forget_draws (surface);
 
     return surface;
 }
@@ -723,6 +724,8 @@ static void qxl_kms_surface_destroy(qxl_surface_t *surf)
     if (surf->host_image)
 	pixman_image_unref (surf->host_image);
 
+    qxl_surface_free_tiles (surf);
+
     if (surf->image_bo)
       qxl->bo_funcs->bo_decref(qxl, surf->image_bo);
     qxl->bo_funcs->bo_decref(qxl, surf->bo);
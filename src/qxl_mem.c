@@ -30,7 +30,7 @@
 #include <unistd.h>
 
 #include "qxl.h"
-#include "mspace.h"
+#include "qxl_mem.h"
 
 #include "qxl_surface.h"
 #ifdef DEBUG_QXL_MEM
@@ -45,18 +45,6 @@
 #define QXL_BO_FLAG_FAIL 1
 
 
-struct qxl_mem
-{
-    mspace	space;
-    void *	base;
-    unsigned long n_bytes;
-#ifdef DEBUG_QXL_MEM
-    size_t used_initial;
-    int unverifiable;
-    int missing;
-#endif
-};
-
 #ifdef DEBUG_QXL_MEM
 void
 qxl_mem_unverifiable(struct qxl_mem *mem)
@@ -149,6 +137,29 @@ qxl_alloc            (struct qxl_mem         *mem,
     return addr;
 }
 
+/* An alignment of 0 leaves it to the allocator */
+static void *
+qxl_alloc_aligned    (struct qxl_mem         *mem,
+		      unsigned long           alignment,
+		      unsigned long           n_bytes,
+		      const char             *name)
+{
+    void *addr;
+
+    if (!alignment)
+	return qxl_alloc (mem, n_bytes, name);
+
+    addr = mspace_memalign (mem->space, alignment, n_bytes);
+
+#ifdef DEBUG_QXL_MEM
+    VALGRIND_MALLOCLIKE_BLOCK(addr, n_bytes, 0, 0);
+#ifdef DEBUG_QXL_MEM_VERBOSE
+    fprintf(stderr, "alloc %p: %ld aligned to %ld (%s)\n", addr, n_bytes, alignment, name);
+#endif
+#endif
+    return addr;
+}
+
 static void
 qxl_free             (struct qxl_mem         *mem,
 		      void                   *d,
@@ -391,6 +402,9 @@ qxl_usleep (int useconds)
 int
 qxl_handle_oom (qxl_screen_t *qxl)
 {
+    /* Queued commands can only be released once the device has them */
+    qxl_upload_worker_sync (qxl);
+
     qxl_io_notify_oom (qxl);
 
 #if 0
@@ -405,7 +419,8 @@ qxl_handle_oom (qxl_screen_t *qxl)
 }
 
 static void *
-qxl_allocnf (qxl_screen_t *qxl, unsigned long size, const char *name)
+qxl_allocnf (qxl_screen_t *qxl, struct qxl_mem *mem, unsigned long alignment,
+	     unsigned long size, const char *name)
 {
     void *result;
     int n_attempts = 0;
@@ -416,11 +431,14 @@ qxl_allocnf (qxl_screen_t *qxl, unsigned long size, const char *name)
 
     qxl_garbage_collect (qxl);
 
-    while (!(result = qxl_alloc (qxl->mem, size, name)))
+    while (!(result = qxl_alloc_aligned (mem, alignment, size, name)))
     {
 #if 0
 	ErrorF ("eliminated memory (%d)\n", nth_oom++);
 #endif
+	/* Sizes based on the old numbers are likely to fail again */
+	mem->stats_age = 0;
+
 	if (!qxl_garbage_collect (qxl))
 	{
 	    if (qxl_handle_oom (qxl))
@@ -430,7 +448,7 @@ qxl_allocnf (qxl_screen_t *qxl, unsigned long size, const char *name)
 	    else if (++n_attempts == 1000)
 	    {
 		ErrorF ("Out of memory allocating %ld bytes\n", size);
-		qxl_mem_dump_stats (qxl->mem, "Out of mem - stats\n");
+		qxl_mem_dump_stats (mem, "Out of mem - stats\n");
 		fprintf (stderr, "Out of memory\n");
 		exit (1);
 	    }
@@ -455,6 +473,7 @@ static struct qxl_bo *qxl_bo_alloc_internal(qxl_screen_t *qxl, int type, int fla
 {
     struct qxl_ums_bo *bo;
     struct qxl_mem *mptr;
+    unsigned long alignment;
 
     bo = calloc(1, sizeof(struct qxl_ums_bo));
     if (!bo)
@@ -465,19 +484,22 @@ static struct qxl_bo *qxl_bo_alloc_internal(qxl_screen_t *qxl, int type, int fla
     bo->type = type;
     bo->qxl = qxl;
     bo->refcnt = 1;
-    if (type == QXL_BO_SURF)
+    if (type == QXL_BO_SURF) {
 	mptr = qxl->surf_mem;
-    else
+	alignment = qxl->surface_alloc_align;
+    } else {
 	mptr = qxl->mem;
+	alignment = 0;
+    }
 
     if (flags & QXL_BO_FLAG_FAIL) {
-	bo->internal_virt_addr = qxl_alloc(mptr, size, name);
+	bo->internal_virt_addr = qxl_alloc_aligned(mptr, alignment, size, name);
 	if (!bo->internal_virt_addr) {
 	    free(bo);
 	    return NULL;
 	}
     } else
-	bo->internal_virt_addr = qxl_allocnf(qxl, size, name);
+	bo->internal_virt_addr = qxl_allocnf(qxl, mptr, alignment, size, name);
 
     if (type != QXL_BO_SURF) {
 	xorg_list_add(&bo->bos, &qxl->ums_bos);
@@ -594,7 +616,7 @@ out_free:
     free(bo);
 }
 
-static void qxl_bo_write_command(qxl_screen_t *qxl, uint32_t cmd_type, struct qxl_bo *bo)
+void qxl_ums_submit_command(qxl_screen_t *qxl, uint32_t cmd_type, struct qxl_bo *bo)
 {
     struct QXLCommand cmd;
 
@@ -625,9 +647,20 @@ static void qxl_bo_write_command(qxl_screen_t *qxl, uint32_t cmd_type, struct qx
     qxl_bo_decref(qxl, bo);
 }
 
+static void qxl_bo_write_command(qxl_screen_t *qxl, uint32_t cmd_type, struct qxl_bo *bo)
+{
+    /* Commands must not overtake images still being filled in */
+    if (qxl->upload_worker && qxl_upload_worker_queue_command(qxl, cmd_type, bo))
+	return;
+
+    qxl_ums_submit_command(qxl, cmd_type, bo);
+}
+
 static void qxl_bo_update_area(qxl_surface_t *surf, int x1, int y1, int x2, int y2)
 {
     struct QXLRam *ram_header = get_ram_header(surf->qxl);
+
+    qxl_upload_worker_sync(surf->qxl);
     
     ram_header->update_area.top = y1;
     ram_header->update_area.bottom = y2;
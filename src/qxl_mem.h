@@ -0,0 +1,48 @@
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* The state of a memory space, shared by the allocator in qxl_mem.c and
+ * the free space statistics in qxl_mem_stats.c
+ */
+
+#ifndef QXL_MEM_H
+#define QXL_MEM_H
+
+#include "mspace.h"
+
+struct qxl_mem
+{
+    mspace	space;
+    void *	base;
+    unsigned long n_bytes;
+
+    /* Cached result of qxl_mem_usable_bytes() */
+    int		stats_age;
+    size_t	usable[MSPACE_FREE_ORDERS];
+#ifdef DEBUG_QXL_MEM
+    size_t used_initial;
+    int unverifiable;
+    int missing;
+#endif
+};
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2009 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Free space statistics of a memory space. They don't need the rest of
+ * the allocator, so the benchmarks build this file too.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "qxl.h"
+#include "qxl_mem.h"
+
+/* Walking the heap is not free, so the numbers are only refreshed every
+ * so often. They are meant as a hint for sizing allocations.
+ */
+#define FREE_STATS_MAX_AGE 32
+
+/* How many bytes could be allocated in blocks of block_size, which is
+ * rounded up to a power of two
+ */
+size_t
+qxl_mem_usable_bytes (struct qxl_mem         *mem,
+		      size_t                  block_size)
+{
+    int order = 0;
+
+    if (mem->stats_age-- <= 0)
+    {
+	size_t free_bytes;
+
+	mspace_free_info (mem->space, &free_bytes, mem->usable);
+	mem->stats_age = FREE_STATS_MAX_AGE;
+    }
+
+    while (order < MSPACE_FREE_ORDERS - 1 && ((size_t)1 << order) < block_size)
+	order++;
+
+    return mem->usable[order];
+}
+
+/* Free bytes, always up to date */
+size_t
+qxl_mem_free_bytes   (struct qxl_mem         *mem)
+{
+    size_t free_bytes;
+
+    mspace_free_info (mem->space, &free_bytes, mem->usable);
+    mem->stats_age = FREE_STATS_MAX_AGE;
+
+    return free_bytes;
+}
@@ -0,0 +1,497 @@
+/*
+ * Copyright 2010 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Packed images
+ *
+ * Surfaces evacuated from the device are kept in this form until they
+ * are needed again. The image is cut into tiles. Tiles of a single colour
+ * are stored as that colour, tiles identical to an earlier tile of the
+ * same image share its data, and the rest is run length encoded, or
+ * stored as is when that doesn't help. Desktop content is mostly flat,
+ * so this is cheap and usually shrinks images a lot.
+ *
+ * Encoded data is a sequence of 16 bit headers, each followed by pixels.
+ * If the top bit of the header is set, the next pixel is repeated as many
+ * times as the lower bits say; otherwise that many pixels follow as is.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "qxl.h"
+#include "murmurhash3.h"
+
+#define PACK_TILE_SIZE	64
+#define RUN_FLAG	0x8000
+#define MAX_COUNT	0x7fff
+#define MIN_RUN		3
+
+enum
+{
+    TILE_SOLID,
+    TILE_RLE,
+    TILE_RAW
+};
+
+typedef struct
+{
+    uint8_t	kind;
+    /* The pixel for solid tiles, otherwise the offset of the data */
+    uint32_t	value;
+} packed_tile_t;
+
+struct qxl_packed_image
+{
+    pixman_format_code_t format;
+    int			width;
+    int			height;
+    int			Bpp;
+    int			n_tiles_x;
+    int			n_tiles_y;
+    packed_tile_t *	tiles;
+    uint8_t *		data;
+    size_t		data_size;
+    size_t		data_alloc;
+};
+
+/* Pixels in packed data follow 16 bit headers, so they may be unaligned */
+static uint32_t
+read_pixel (const uint8_t *p, int Bpp)
+{
+    uint8_t v8;
+    uint16_t v16;
+    uint32_t v32;
+
+    switch (Bpp)
+    {
+    case 1:
+	v8 = *p;
+	return v8;
+    case 2:
+	memcpy (&v16, p, sizeof v16);
+	return v16;
+    default:
+	memcpy (&v32, p, sizeof v32);
+	return v32;
+    }
+}
+
+static void
+write_pixel (uint8_t *p, int Bpp, uint32_t pixel)
+{
+    uint16_t v16 = pixel;
+
+    switch (Bpp)
+    {
+    case 1:
+	*p = pixel;
+	break;
+    case 2:
+	memcpy (p, &v16, sizeof v16);
+	break;
+    default:
+	memcpy (p, &pixel, sizeof pixel);
+	break;
+    }
+}
+
+static uint8_t *
+reserve (qxl_packed_image_t *packed, size_t size)
+{
+    if (packed->data_size + size > packed->data_alloc)
+    {
+	size_t n_alloc = packed->data_alloc ? packed->data_alloc : 4096;
+	uint8_t *data;
+
+	while (n_alloc < packed->data_size + size)
+	    n_alloc *= 2;
+
+	if (!(data = realloc (packed->data, n_alloc)))
+	    return NULL;
+
+	packed->data = data;
+	packed->data_alloc = n_alloc;
+    }
+
+    return packed->data + packed->data_size;
+}
+
+static uint8_t *
+emit (uint8_t *out, int Bpp, uint16_t header, const uint32_t *pixels, int n)
+{
+    int i;
+
+    memcpy (out, &header, sizeof header);
+    out += sizeof header;
+
+    for (i = 0; i < n; ++i)
+    {
+	write_pixel (out, Bpp, pixels[i]);
+	out += Bpp;
+    }
+
+    return out;
+}
+
+/* Encode n pixels into out, which must have room for the worst case.
+ * Returns the number of bytes written.
+ */
+static size_t
+rle_encode (const uint32_t *pixels, int n, int Bpp, uint8_t *out)
+{
+    uint8_t *start = out;
+    int i = 0;
+
+    while (i < n)
+    {
+	int run = 1;
+
+	while (i + run < n && run < MAX_COUNT && pixels[i + run] == pixels[i])
+	    run++;
+
+	if (run >= MIN_RUN)
+	{
+	    out = emit (out, Bpp, RUN_FLAG | run, pixels + i, 1);
+	    i += run;
+	}
+	else
+	{
+	    int lit = 0;
+
+	    /* Literal pixels up to the next run worth encoding */
+	    while (i + lit < n && lit < MAX_COUNT)
+	    {
+		if (i + lit + MIN_RUN <= n &&
+		    pixels[i + lit] == pixels[i + lit + 1] &&
+		    pixels[i + lit] == pixels[i + lit + 2])
+		{
+		    break;
+		}
+		lit++;
+	    }
+
+	    out = emit (out, Bpp, lit, pixels + i, lit);
+	    i += lit;
+	}
+    }
+
+    return out - start;
+}
+
+static void
+rle_decode (const uint8_t *in, int Bpp, uint8_t *dest, int dest_stride,
+	    int width, int height)
+{
+    int x = 0, y = 0;
+
+    while (y < height)
+    {
+	uint16_t header;
+	int count, i;
+
+	memcpy (&header, in, sizeof header);
+	in += sizeof header;
+	count = header & MAX_COUNT;
+
+	for (i = 0; i < count; ++i)
+	{
+	    uint32_t pixel;
+
+	    if (header & RUN_FLAG)
+	    {
+		pixel = read_pixel (in, Bpp);
+	    }
+	    else
+	    {
+		pixel = read_pixel (in, Bpp);
+		in += Bpp;
+	    }
+
+	    write_pixel (dest + y * dest_stride + x * Bpp, Bpp, pixel);
+
+	    if (++x == width)
+	    {
+		x = 0;
+		y++;
+	    }
+	}
+
+	if (header & RUN_FLAG)
+	    in += Bpp;
+    }
+}
+
+static uint64_t
+hash_tile (const uint8_t *data, int stride, int Bpp, int width, int height)
+{
+    uint64_t hash = width * 0x10000ULL + height;
+    int y;
+
+    for (y = 0; y < height; ++y)
+    {
+	uint64_t row[2];
+
+	MurmurHash3_x64_128 (data + y * stride, width * Bpp, y, row);
+
+	hash = (hash ^ row[0]) * 0x9e3779b97f4a7c15ULL + row[1];
+    }
+
+    return hash;
+}
+
+static Bool
+tiles_equal (const uint8_t *a, const uint8_t *b, int stride, int row_bytes,
+	     int height)
+{
+    int y;
+
+    for (y = 0; y < height; ++y)
+    {
+	if (memcmp (a + y * stride, b + y * stride, row_bytes) != 0)
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+tile_rect (qxl_packed_image_t *packed, int tile, int *x, int *y, int *w, int *h)
+{
+    *x = (tile % packed->n_tiles_x) * PACK_TILE_SIZE;
+    *y = (tile / packed->n_tiles_x) * PACK_TILE_SIZE;
+    *w = MIN (PACK_TILE_SIZE, packed->width - *x);
+    *h = MIN (PACK_TILE_SIZE, packed->height - *y);
+}
+
+qxl_packed_image_t *
+qxl_pack_image (pixman_image_t *image)
+{
+    const uint8_t *data = (const uint8_t *)pixman_image_get_data (image);
+    int stride = pixman_image_get_stride (image);
+    qxl_packed_image_t *packed;
+    uint32_t pixels[PACK_TILE_SIZE * PACK_TILE_SIZE];
+    uint64_t *hashes = NULL;
+    int *slots = NULL;
+    int n_tiles, n_slots, tile;
+
+    if (!(packed = calloc (1, sizeof *packed)))
+	return NULL;
+
+    packed->format = pixman_image_get_format (image);
+    packed->width = pixman_image_get_width (image);
+    packed->height = pixman_image_get_height (image);
+    packed->Bpp = PIXMAN_FORMAT_BPP (packed->format) / 8;
+    packed->n_tiles_x = (packed->width + PACK_TILE_SIZE - 1) / PACK_TILE_SIZE;
+    packed->n_tiles_y = (packed->height + PACK_TILE_SIZE - 1) / PACK_TILE_SIZE;
+    n_tiles = packed->n_tiles_x * packed->n_tiles_y;
+
+    n_slots = 16;
+    while (n_slots < 2 * n_tiles)
+	n_slots *= 2;
+
+    packed->tiles = malloc (n_tiles * sizeof (packed_tile_t));
+    hashes = malloc (n_tiles * sizeof (uint64_t));
+    slots = calloc (n_slots, sizeof (int));
+    if (!packed->tiles || !hashes || !slots)
+	goto fail;
+
+    for (tile = 0; tile < n_tiles; ++tile)
+    {
+	packed_tile_t *pt = &packed->tiles[tile];
+	int Bpp = packed->Bpp;
+	int x, y, w, h, i, n, slot;
+	const uint8_t *src;
+	size_t raw_size, size;
+	uint8_t *out;
+
+	tile_rect (packed, tile, &x, &y, &w, &h);
+	src = data + y * stride + x * Bpp;
+
+	n = 0;
+	for (i = 0; i < h; ++i)
+	{
+	    int j;
+
+	    for (j = 0; j < w; ++j)
+		pixels[n++] = read_pixel (src + i * stride + j * Bpp, Bpp);
+	}
+
+	for (i = 1; i < n; ++i)
+	{
+	    if (pixels[i] != pixels[0])
+		break;
+	}
+
+	if (i == n)
+	{
+	    pt->kind = TILE_SOLID;
+	    pt->value = pixels[0];
+	    continue;
+	}
+
+	/* Share the data of an identical earlier tile */
+	hashes[tile] = hash_tile (src, stride, Bpp, w, h);
+	slot = hashes[tile] & (n_slots - 1);
+	while (slots[slot])
+	{
+	    int other = slots[slot] - 1;
+	    int ox, oy, ow, oh;
+
+	    tile_rect (packed, other, &ox, &oy, &ow, &oh);
+
+	    if (hashes[other] == hashes[tile] && ow == w && oh == h &&
+		tiles_equal (src, data + oy * stride + ox * Bpp,
+			     stride, w * Bpp, h))
+	    {
+		break;
+	    }
+
+	    slot = (slot + 1) & (n_slots - 1);
+	}
+
+	if (slots[slot])
+	{
+	    *pt = packed->tiles[slots[slot] - 1];
+	    continue;
+	}
+
+	slots[slot] = tile + 1;
+
+	/* Worst case is one header per pixel */
+	raw_size = (size_t)n * Bpp;
+	if (!(out = reserve (packed, raw_size + n * sizeof (uint16_t))))
+	    goto fail;
+
+	pt->value = packed->data_size;
+
+	size = rle_encode (pixels, n, Bpp, out);
+	if (size < raw_size)
+	{
+	    pt->kind = TILE_RLE;
+	}
+	else
+	{
+	    for (i = 0; i < h; ++i)
+		memcpy (out + i * w * Bpp, src + i * stride, w * Bpp);
+
+	    pt->kind = TILE_RAW;
+	    size = raw_size;
+	}
+
+	packed->data_size += size;
+    }
+
+    free (hashes);
+    free (slots);
+
+    /* Give back what the worst case estimates reserved */
+    if (packed->data_size && packed->data_size < packed->data_alloc)
+    {
+	uint8_t *shrunk = realloc (packed->data, packed->data_size);
+
+	if (shrunk)
+	{
+	    packed->data = shrunk;
+	    packed->data_alloc = packed->data_size;
+	}
+    }
+
+    return packed;
+
+fail:
+    free (hashes);
+    free (slots);
+    qxl_packed_image_free (packed);
+
+    return NULL;
+}
+
+void
+qxl_unpack_image (qxl_packed_image_t *packed, pixman_image_t *dest)
+{
+    uint8_t *data = (uint8_t *)pixman_image_get_data (dest);
+    int stride = pixman_image_get_stride (dest);
+    int Bpp = packed->Bpp;
+    int n_tiles = packed->n_tiles_x * packed->n_tiles_y;
+    int tile;
+
+    for (tile = 0; tile < n_tiles; ++tile)
+    {
+	packed_tile_t *pt = &packed->tiles[tile];
+	int x, y, w, h, i;
+	uint8_t *d;
+
+	tile_rect (packed, tile, &x, &y, &w, &h);
+	d = data + y * stride + x * Bpp;
+
+	switch (pt->kind)
+	{
+	case TILE_SOLID:
+	    pixman_fill ((uint32_t *)data, stride / 4, Bpp * 8,
+			 x, y, w, h, pt->value);
+	    break;
+
+	case TILE_RLE:
+	    rle_decode (packed->data + pt->value, Bpp, d, stride, w, h);
+	    break;
+
+	case TILE_RAW:
+	    for (i = 0; i < h; ++i)
+		memcpy (d + i * stride, packed->data + pt->value + i * w * Bpp, w * Bpp);
+	    break;
+	}
+    }
+}
+
+void
+qxl_packed_image_get_info (qxl_packed_image_t   *packed,
+			   pixman_format_code_t *format,
+			   int                  *width,
+			   int                  *height)
+{
+    *format = packed->format;
+    *width = packed->width;
+    *height = packed->height;
+}
+
+size_t
+qxl_packed_image_size (qxl_packed_image_t *packed)
+{
+    return sizeof *packed +
+	packed->n_tiles_x * packed->n_tiles_y * sizeof (packed_tile_t) +
+	packed->data_alloc;
+}
+
+void
+qxl_packed_image_free (qxl_packed_image_t *packed)
+{
+    if (!packed)
+	return;
+
+    free (packed->tiles);
+    free (packed->data);
+    free (packed);
+}
@@ -0,0 +1,285 @@
+/*
+ * Copyright 2009, 2010 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Pixmap placement policy
+ *
+ * The PixmapPlacement option is a list of rules, separated by spaces or
+ * commas, of the form
+ *
+ *     HINT[/DEPTH][@MIN[-MAX]]=device|host
+ *
+ * where HINT is the usage hint passed to CreatePixmap (normal, scratch,
+ * backing, glyph, shared, other or any), DEPTH a pixmap depth and MIN and
+ * MAX bounds on the area of the pixmap in pixels. The first rule matching
+ * a new pixmap decides whether a surface is created for it; pixmaps no
+ * rule matches go to the device.
+ *
+ * For instance "glyph=host scratch@0-4096=host" keeps glyph pixmaps and
+ * small scratch pixmaps in system memory.
+ *
+ * Whatever the policy, pixmaps the device cannot hold are kept in system
+ * memory. How pixmaps of each class end up being used is counted, so the
+ * policy can be tuned from the statistics printed when the server exits.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qxl.h"
+#include "qxl_surface.h"
+
+struct qxl_placement_rule
+{
+    int		usage_class;	/* -1 for any */
+    int		depth;		/* 0 for any */
+    long	min_area;
+    long	max_area;
+    Bool	on_device;
+};
+
+static const char *const class_names[QXL_N_USAGE_CLASSES] =
+{
+    "normal", "scratch", "backing", "glyph", "shared", "other"
+};
+
+int
+qxl_placement_class (unsigned usage)
+{
+    switch (usage)
+    {
+    case 0:
+	return QXL_USAGE_NORMAL;
+    case CREATE_PIXMAP_USAGE_SCRATCH:
+	return QXL_USAGE_SCRATCH;
+    case CREATE_PIXMAP_USAGE_BACKING_PIXMAP:
+	return QXL_USAGE_BACKING;
+    case CREATE_PIXMAP_USAGE_GLYPH_PICTURE:
+	return QXL_USAGE_GLYPH;
+#ifdef CREATE_PIXMAP_USAGE_SHARED
+    case CREATE_PIXMAP_USAGE_SHARED:
+	return QXL_USAGE_SHARED;
+#endif
+    default:
+	return QXL_USAGE_OTHER;
+    }
+}
+
+static Bool
+parse_class (const char *name, size_t len, int *usage_class)
+{
+    int i;
+
+    if ((len == 3 && strncmp (name, "any", 3) == 0)		||
+	(len == 7 && strncmp (name, "default", 7) == 0))
+    {
+	*usage_class = -1;
+	return TRUE;
+    }
+
+    for (i = 0; i < QXL_N_USAGE_CLASSES; ++i)
+    {
+	if (strlen (class_names[i]) == len &&
+	    strncmp (name, class_names[i], len) == 0)
+	{
+	    *usage_class = i;
+	    return TRUE;
+	}
+    }
+
+    return FALSE;
+}
+
+static Bool
+parse_rule (const char *s, qxl_placement_rule_t *rule)
+{
+    const char *end = s + strcspn (s, "/@=");
+    char *next;
+
+    if (!parse_class (s, end - s, &rule->usage_class))
+	return FALSE;
+
+    rule->depth = 0;
+    rule->min_area = 0;
+    rule->max_area = LONG_MAX;
+
+    s = end;
+    if (*s == '/')
+    {
+	rule->depth = strtol (s + 1, &next, 10);
+	if (next == s + 1 || rule->depth <= 0 || rule->depth > 32)
+	    return FALSE;
+	s = next;
+    }
+
+    if (*s == '@')
+    {
+	rule->min_area = strtol (s + 1, &next, 10);
+	if (next == s + 1 || rule->min_area < 0)
+	    return FALSE;
+	s = next;
+
+	if (*s == '-')
+	{
+	    rule->max_area = strtol (s + 1, &next, 10);
+	    if (next == s + 1 || rule->max_area < rule->min_area)
+		return FALSE;
+	    s = next;
+	}
+    }
+
+    if (strcmp (s, "=device") == 0)
+	rule->on_device = TRUE;
+    else if (strcmp (s, "=host") == 0)
+	rule->on_device = FALSE;
+    else
+	return FALSE;
+
+    return TRUE;
+}
+
+void
+qxl_placement_init (qxl_screen_t *qxl, const char *policy)
+{
+    char *copy, *token, *save;
+    int n_rules = 0;
+
+    memset (qxl->placement_stats, 0, sizeof (qxl->placement_stats));
+
+    free (qxl->placement_rules);
+    qxl->placement_rules = NULL;
+    qxl->n_placement_rules = 0;
+
+    if (!policy || !*policy)
+	return;
+
+    copy = xnfstrdup (policy);
+
+    /* One rule per token is enough */
+    for (token = copy; *token; ++token)
+	n_rules += (*token == ' ' || *token == ',');
+
+    qxl->placement_rules = xnfalloc ((n_rules + 1) * sizeof (qxl_placement_rule_t));
+
+    for (token = strtok_r (copy, " ,", &save);
+	 token != NULL;
+	 token = strtok_r (NULL, " ,", &save))
+    {
+	qxl_placement_rule_t *rule =
+	    &qxl->placement_rules[qxl->n_placement_rules];
+
+	if (parse_rule (token, rule))
+	    qxl->n_placement_rules++;
+	else
+	    xf86DrvMsg (qxl->pScrn->scrnIndex, X_WARNING,
+			"Ignoring invalid pixmap placement rule \"%s\"\n", token);
+    }
+
+    free (copy);
+}
+
+Bool
+qxl_placement_on_device (qxl_screen_t *qxl,
+			 int width, int height, int depth, int usage_class)
+{
+    long area = (long)width * height;
+    int i;
+
+    for (i = 0; i < qxl->n_placement_rules; ++i)
+    {
+	qxl_placement_rule_t *rule = &qxl->placement_rules[i];
+
+	if (rule->usage_class != -1 && rule->usage_class != usage_class)
+	    continue;
+	if (rule->depth && rule->depth != depth)
+	    continue;
+	if (area < rule->min_area || area > rule->max_area)
+	    continue;
+
+	if (!rule->on_device)
+	    qxl->placement_stats[usage_class].on_host++;
+
+	return rule->on_device;
+    }
+
+    return TRUE;
+}
+
+void
+qxl_placement_created (qxl_surface_t *surface, int usage_class)
+{
+    surface->usage_class = usage_class;
+    surface->qxl->placement_stats[usage_class].on_device++;
+}
+
+/* Counts how pixmaps of each usage class get drawn to */
+void
+qxl_placement_count (qxl_surface_t *surface, Bool accelerated)
+{
+    qxl_placement_stats_t *stats;
+
+    if (!surface)
+	return;
+
+    stats = &surface->qxl->placement_stats[surface->usage_class];
+    if (accelerated)
+    {
+	stats->accelerated++;
+	surface->accel_ops++;
+    }
+    else
+    {
+	stats->fallbacks++;
+	surface->sw_accesses++;
+    }
+}
+
+void
+qxl_placement_dump_stats (qxl_screen_t *qxl)
+{
+    int i;
+
+    ErrorF ("Pixmap placement:\n");
+    ErrorF ("  %-8s %10s %10s %10s %12s %10s %9s\n",
+	    "usage", "device", "host", "failed",
+	    "accelerated", "software", "fallback");
+
+    for (i = 0; i < QXL_N_USAGE_CLASSES; ++i)
+    {
+	qxl_placement_stats_t *stats = &qxl->placement_stats[i];
+	unsigned long n_ops = stats->accelerated + stats->fallbacks;
+	unsigned long n_pixmaps = stats->on_device + stats->on_host + stats->failed;
+
+	if (!n_pixmaps)
+	    continue;
+
+	ErrorF ("  %-8s %10lu %10lu %10lu %12lu %10lu %8lu%%\n",
+		class_names[i],
+		stats->on_device, stats->on_host, stats->failed,
+		stats->accelerated, stats->fallbacks,
+		n_ops? stats->fallbacks * 100 / n_ops : 0);
+    }
+}
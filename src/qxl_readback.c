@@ -0,0 +1,130 @@
+/*
+ * Copyright 2010 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Readback from video memory
+ *
+ * The device image lives in write combined video memory, where ordinary
+ * loads are uncached and very slow. The SSE4.1 streaming load reads a
+ * whole cache line into a fill buffer at once, so rows are read with it
+ * one cache line at a time when the CPU supports it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "qxl.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_STREAM_LOAD
+#include <smmintrin.h>
+#endif
+
+#ifdef HAVE_STREAM_LOAD
+__attribute__((target ("sse4.1")))
+static void
+stream_copy_rows (uint8_t *dest, int dest_stride,
+		  const uint8_t *src, int src_stride,
+		  int width, int height)
+{
+    while (height--)
+    {
+	const uint8_t *s = src;
+	uint8_t *d = dest;
+	int len = width;
+	int head = (16 - ((uintptr_t)s & 15)) & 15;
+
+	if (head > len)
+	    head = len;
+
+	memcpy (d, s, head);
+	s += head;
+	d += head;
+	len -= head;
+
+	for (; len >= 64; len -= 64)
+	{
+	    __m128i a = _mm_stream_load_si128 ((__m128i *)(s + 0));
+	    __m128i b = _mm_stream_load_si128 ((__m128i *)(s + 16));
+	    __m128i c = _mm_stream_load_si128 ((__m128i *)(s + 32));
+	    __m128i e = _mm_stream_load_si128 ((__m128i *)(s + 48));
+
+	    _mm_storeu_si128 ((__m128i *)(d + 0), a);
+	    _mm_storeu_si128 ((__m128i *)(d + 16), b);
+	    _mm_storeu_si128 ((__m128i *)(d + 32), c);
+	    _mm_storeu_si128 ((__m128i *)(d + 48), e);
+
+	    s += 64;
+	    d += 64;
+	}
+
+	for (; len >= 16; len -= 16)
+	{
+	    _mm_storeu_si128 ((__m128i *)d,
+			      _mm_stream_load_si128 ((__m128i *)s));
+	    s += 16;
+	    d += 16;
+	}
+
+	memcpy (d, s, len);
+
+	src += src_stride;
+	dest += dest_stride;
+    }
+}
+
+static Bool
+have_stream_load (void)
+{
+    static int supported = -1;
+
+    if (supported < 0)
+    {
+	__builtin_cpu_init ();
+	supported = __builtin_cpu_supports ("sse4.1") ? 1 : 0;
+    }
+
+    return supported;
+}
+#endif
+
+/* Copy width bytes of height rows from video memory. Returns FALSE,
+ * without copying anything, if there is no faster way to do it than an
+ * ordinary copy.
+ */
+Bool
+qxl_readback_rows (uint8_t *dest, int dest_stride,
+		   const uint8_t *src, int src_stride,
+		   int width, int height)
+{
+#ifdef HAVE_STREAM_LOAD
+    if (have_stream_load ())
+    {
+	stream_copy_rows (dest, dest_stride, src, src_stride, width, height);
+	return TRUE;
+    }
+#endif
+
+    return FALSE;
+}
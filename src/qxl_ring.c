@@ -154,3 +154,16 @@ qxl_ring_prod (struct qxl_ring *ring)
 {
     return ring->ring->header.prod;
 }
+
+/* Number of elements pushed and not consumed yet */
+int
+qxl_ring_used (struct qxl_ring *ring)
+{
+    return ring->ring->header.prod - ring->ring->header.cons;
+}
+
+int
+qxl_ring_size (struct qxl_ring *ring)
+{
+    return ring->n_elements;
+}
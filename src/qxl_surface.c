@@ -24,8 +24,15 @@
 #include "config.h"
 #endif
 
+#include <limits.h>
+
 #include "qxl.h"
 #include "qxl_surface.h"/* send anything pending to the other side */
+#include "murmurhash3.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 enum ROPDescriptor
@@ -43,6 +50,63 @@ enum ROPDescriptor
     ROPD_INVERS_RES = (1 <<10),
 };
 
+/* Repeated drawing
+ *
+ * Toolkits often fill or copy the same rectangle several times in a row,
+ * when redrawing a widget for instance. Each surface remembers the last
+ * fill or copy sent to it, until something else is drawn over its
+ * rectangle. For copies, the serial number the source had at the time is
+ * remembered too, since every drawing command gives its surface a new
+ * one. A command that repeats the remembered one would leave the surface
+ * unchanged, so it is dropped instead of being sent to the device.
+ *
+ * Copies within a surface are never dropped, since repeating them can
+ * move pixels further.
+ */
+static uint32_t draw_serial;
+
+void
+qxl_surface_forget_draws (qxl_surface_t *surface)
+{
+    surface->last_draw.type = 0;
+    surface->serial = ++draw_serial;
+}
+
+static Bool
+rects_intersect (const struct QXLRect *a, const struct QXLRect *b)
+{
+    return a->left < b->right && b->left < a->right &&
+	a->top < b->bottom && b->top < a->bottom;
+}
+
+static Bool
+rects_equal (const struct QXLRect *a, const struct QXLRect *b)
+{
+    return a->left == b->left && a->right == b->right &&
+	a->top == b->top && a->bottom == b->bottom;
+}
+
+static Bool
+is_repeated_fill (qxl_surface_t *surface,
+		  const struct QXLRect *rect, uint32_t color)
+{
+    return surface->last_draw.type == QXL_DRAW_FILL &&
+	surface->last_draw.color == color &&
+	rects_equal (&surface->last_draw.rect, rect);
+}
+
+static Bool
+is_repeated_copy (qxl_surface_t *surface, qxl_surface_t *src,
+		  int src_x, int src_y, const struct QXLRect *rect)
+{
+    return surface->last_draw.type == QXL_DRAW_COPY &&
+	surface->last_draw.src == src &&
+	surface->last_draw.src_serial == src->serial &&
+	surface->last_draw.src_x == src_x &&
+	surface->last_draw.src_y == src_y &&
+	rects_equal (&surface->last_draw.rect, rect);
+}
+
 static struct qxl_bo *
 make_drawable (qxl_screen_t *qxl, qxl_surface_t *surf, uint8_t type,
 	       const struct QXLRect *rect
@@ -51,6 +115,10 @@ make_drawable (qxl_screen_t *qxl, qxl_surface_t *surf, uint8_t type,
     struct QXLDrawable *drawable;
     struct qxl_bo *draw_bo;
     int i;
+
+    surf->serial = ++draw_serial;
+    if (!rect || rects_intersect (&surf->last_draw.rect, rect))
+	surf->last_draw.type = 0;
    
     draw_bo = qxl->bo_funcs->cmd_alloc (qxl, sizeof *drawable, "drawable command");
     assert(draw_bo);
@@ -106,6 +174,12 @@ submit_fill (qxl_screen_t *qxl, qxl_surface_t *surf,
 {
     struct qxl_bo *drawable_bo;
     struct QXLDrawable *drawable;
+
+    if (is_repeated_fill (surf, rect, color))
+    {
+	qxl->repeated_fills++;
+	return;
+    }
     
     drawable_bo = make_drawable (qxl, surf, QXL_DRAW_FILL, rect);
     
@@ -121,6 +195,17 @@ submit_fill (qxl_screen_t *qxl, qxl_surface_t *surf,
     qxl->bo_funcs->bo_unmap(drawable_bo);
 
     push_drawable (qxl, drawable_bo);
+
+    surf->last_draw.type = QXL_DRAW_FILL;
+    surf->last_draw.rect = *rect;
+    surf->last_draw.color = color;
+}
+
+void
+qxl_surface_dump_stats (qxl_screen_t *qxl)
+{
+    ErrorF ("Repeated drawing: %lu fills, %lu copies dropped\n",
+	    qxl->repeated_fills, qxl->repeated_copies);
 }
 
 void
@@ -129,10 +214,135 @@ qxl_surface_flush (qxl_surface_t *surface)
     ;
 }
 
+/* Applications often repaint areas with exactly the pixels that are
+ * already there, for example on expose. To avoid sending those again,
+ * a hash of the content last uploaded is kept for each tile of a fixed
+ * grid, and tiles that hash to the same value are skipped. Any device
+ * side rendering to a tile invalidates its hash.
+ *
+ * The same grid records which tiles of the host image match the device,
+ * so that software fallbacks only read back tiles that were rendered to
+ * since the last time.
+ */
+#define HASH_TILE_SIZE 64
+
+#define TILE_BIT_IS_SET(bits, i)	((bits)[(i) >> 5] & (1U << ((i) & 31)))
+#define TILE_BIT_SET(bits, i)		((bits)[(i) >> 5] |= (1U << ((i) & 31)))
+#define TILE_BIT_CLEAR(bits, i)		((bits)[(i) >> 5] &= ~(1U << ((i) & 31)))
+
+static Bool
+ensure_tiles (qxl_surface_t *surface)
+{
+    int n_tiles;
+
+    if (surface->tile_hashes)
+	return TRUE;
+
+    surface->n_tiles_x =
+	(pixman_image_get_width (surface->dev_image) + HASH_TILE_SIZE - 1) / HASH_TILE_SIZE;
+    surface->n_tiles_y =
+	(pixman_image_get_height (surface->dev_image) + HASH_TILE_SIZE - 1) / HASH_TILE_SIZE;
+    n_tiles = surface->n_tiles_x * surface->n_tiles_y;
+
+    surface->tile_hashes = malloc (n_tiles * sizeof (uint64_t));
+    surface->tile_hashes_valid = calloc ((n_tiles + 31) / 32, sizeof (uint32_t));
+    surface->tile_solid = calloc ((n_tiles + 31) / 32, sizeof (uint32_t));
+    surface->host_valid = calloc ((n_tiles + 31) / 32, sizeof (uint32_t));
+
+    if (!surface->tile_hashes || !surface->tile_hashes_valid ||
+	!surface->tile_solid || !surface->host_valid)
+    {
+	qxl_surface_free_tiles (surface);
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
+void
+qxl_surface_free_tiles (qxl_surface_t *surface)
+{
+    free (surface->tile_hashes);
+    free (surface->tile_hashes_valid);
+    free (surface->tile_solid);
+    free (surface->host_valid);
+
+    surface->tile_hashes = NULL;
+    surface->tile_hashes_valid = NULL;
+    surface->tile_solid = NULL;
+    surface->host_valid = NULL;
+    surface->n_tiles_x = 0;
+    surface->n_tiles_y = 0;
+
+    surface->host_generation = surface->dev_generation - 1;
+}
+
+void
+qxl_surface_invalidate_tiles (qxl_surface_t *surface,
+			      int x1, int y1, int x2, int y2)
+{
+    int tx, ty;
+
+    surface->dev_generation++;
+
+    if (!surface->tile_hashes)
+	return;
+
+    x1 = MAX (x1, 0) / HASH_TILE_SIZE;
+    y1 = MAX (y1, 0) / HASH_TILE_SIZE;
+    x2 = MIN ((x2 + HASH_TILE_SIZE - 1) / HASH_TILE_SIZE, surface->n_tiles_x);
+    y2 = MIN ((y2 + HASH_TILE_SIZE - 1) / HASH_TILE_SIZE, surface->n_tiles_y);
+
+    for (ty = y1; ty < y2; ++ty)
+    {
+	for (tx = x1; tx < x2; ++tx)
+	{
+	    int tile = ty * surface->n_tiles_x + tx;
+
+	    TILE_BIT_CLEAR (surface->tile_hashes_valid, tile);
+	    TILE_BIT_CLEAR (surface->host_valid, tile);
+	}
+    }
+}
+
 /* access */
+
 static void
 download_box_no_update (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
 {
+    pixman_image_t *dev = surface->dev_image;
+    pixman_image_t *host = surface->host_image;
+
+    if (pixman_image_get_format (dev) == pixman_image_get_format (host))
+    {
+	int Bpp = PIXMAN_FORMAT_BPP (pixman_image_get_format (host)) / 8;
+	int src_stride = pixman_image_get_stride (dev);
+	int dest_stride = pixman_image_get_stride (host);
+
+	/* Unlike the composite below, the copy doesn't clip. The two
+	 * images may differ in size, for example the primary surface when
+	 * the virtual size is larger than the mode.
+	 */
+	x1 = MAX (x1, 0);
+	y1 = MAX (y1, 0);
+	x2 = MIN (x2, MIN (pixman_image_get_width (host),
+			   pixman_image_get_width (dev)));
+	y2 = MIN (y2, MIN (pixman_image_get_height (host),
+			   pixman_image_get_height (dev)));
+	if (x1 >= x2 || y1 >= y2)
+	    return;
+
+	if (qxl_readback_rows (
+		(uint8_t *)pixman_image_get_data (host) + y1 * dest_stride + x1 * Bpp,
+		dest_stride,
+		(uint8_t *)pixman_image_get_data (dev) + y1 * src_stride + x1 * Bpp,
+		src_stride,
+		(x2 - x1) * Bpp, y2 - y1))
+	{
+	    return;
+	}
+    }
+
     pixman_image_composite (PIXMAN_OP_SRC,
                             surface->dev_image,
                             NULL,
@@ -153,20 +363,173 @@ qxl_download_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
     download_box_no_update(surface, x1, y1, x2, y2);
 }
 
+/* Neither the device nor spice-server can update a list of rectangles
+ * in one request, and every update_area is a synchronous round trip.
+ * So the extents of the region are updated once, which makes the device
+ * render everything pending in there, and then only the boxes of the
+ * region are copied.
+ */
+static void
+download_region (qxl_surface_t *surface, RegionPtr region)
+{
+    BoxPtr extents = REGION_EXTENTS (NULL, region);
+    int n_boxes = REGION_NUM_RECTS (region);
+    BoxPtr boxes = REGION_RECTS (region);
+
+    if (!n_boxes)
+	return;
+
+    surface->qxl->bo_funcs->update_area (
+	surface, extents->x1, extents->y1, extents->x2, extents->y2);
+
+    while (n_boxes--)
+    {
+	download_box_no_update (surface, boxes->x1, boxes->y1, boxes->x2, boxes->y2);
+
+	boxes++;
+    }
+}
+
+/* Whether every tile of the host image holds the device contents */
+static Bool
+host_image_all_valid (qxl_surface_t *surface)
+{
+    int n_tiles = surface->n_tiles_x * surface->n_tiles_y;
+    int i;
+
+    for (i = 0; i < n_tiles / 32; ++i)
+    {
+	if (surface->host_valid[i] != 0xffffffff)
+	    return FALSE;
+    }
+
+    for (i = i * 32; i < n_tiles; ++i)
+    {
+	if (!TILE_BIT_IS_SET (surface->host_valid, i))
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Compute the part of region that has to be read back from the device.
+ * Whole tiles are read back where possible so that they can be marked
+ * valid. Tiles overlapping the access region may hold host writes that
+ * have not been uploaded yet; only the requested part of those is read,
+ * and they stay invalid.
+ *
+ * Returns FALSE if validity can't be tracked, in which case all of
+ * region must be read back.
+ */
+static Bool
+stale_tiles (qxl_surface_t *surface, RegionPtr region, RegionPtr stale)
+{
+    int width = pixman_image_get_width (surface->host_image);
+    int height = pixman_image_get_height (surface->host_image);
+    Bool have_access = REGION_NOTEMPTY (NULL, &surface->access_region);
+    BoxPtr boxes, tiles;
+    RegionRec partial;
+    int n_boxes, n_tiles;
+
+    if (!ensure_tiles (surface))
+	return FALSE;
+
+    n_boxes = REGION_NUM_RECTS (region);
+    boxes = REGION_RECTS (region);
+
+    /* Each tile is added at most once, since it is marked valid when
+     * it is added.
+     */
+    tiles = malloc (surface->n_tiles_x * surface->n_tiles_y * sizeof (BoxRec));
+    if (!tiles)
+	return FALSE;
+
+    n_tiles = 0;
+    REGION_INIT (NULL, &partial, (BoxPtr)NULL, 0);
+
+    while (n_boxes--)
+    {
+	int tx1 = MAX (boxes->x1, 0) / HASH_TILE_SIZE;
+	int ty1 = MAX (boxes->y1, 0) / HASH_TILE_SIZE;
+	int tx2 = MIN ((boxes->x2 + HASH_TILE_SIZE - 1) / HASH_TILE_SIZE, surface->n_tiles_x);
+	int ty2 = MIN ((boxes->y2 + HASH_TILE_SIZE - 1) / HASH_TILE_SIZE, surface->n_tiles_y);
+	int tx, ty;
+
+	for (ty = ty1; ty < ty2; ++ty)
+	{
+	    for (tx = tx1; tx < tx2; ++tx)
+	    {
+		int tile = ty * surface->n_tiles_x + tx;
+		BoxRec box;
+
+		if (TILE_BIT_IS_SET (surface->host_valid, tile))
+		    continue;
+
+		box.x1 = tx * HASH_TILE_SIZE;
+		box.y1 = ty * HASH_TILE_SIZE;
+		box.x2 = MIN (box.x1 + HASH_TILE_SIZE, width);
+		box.y2 = MIN (box.y1 + HASH_TILE_SIZE, height);
+
+		if (have_access &&
+		    RECT_IN_REGION (NULL, &surface->access_region, &box) != rgnOUT)
+		{
+		    RegionRec r;
+
+		    REGION_INIT (NULL, &r, &box, 1);
+		    REGION_UNION (NULL, &partial, &partial, &r);
+		    REGION_UNINIT (NULL, &r);
+		}
+		else
+		{
+		    TILE_BIT_SET (surface->host_valid, tile);
+
+		    /* Merge with the previous tile of the same row */
+		    if (n_tiles && tiles[n_tiles - 1].x2 == box.x1 &&
+			tiles[n_tiles - 1].y1 == box.y1)
+		    {
+			tiles[n_tiles - 1].x2 = box.x2;
+		    }
+		    else
+		    {
+			tiles[n_tiles++] = box;
+		    }
+		}
+	    }
+	}
+
+	boxes++;
+    }
+
+    pixman_region_init_rects (stale, tiles, n_tiles);
+
+    REGION_INTERSECT (NULL, &partial, &partial, region);
+    REGION_UNION (NULL, stale, stale, &partial);
+
+    REGION_UNINIT (NULL, &partial);
+    free (tiles);
+
+    return TRUE;
+}
+
+/* Make region of the host image hold the device contents, for software
+ * rendering. This is qxl_surface_prepare_access() without the pixmap,
+ * so it works for the tiles of tiled pixmaps too.
+ */
 Bool
-qxl_surface_prepare_access (qxl_surface_t  *surface,
-			    PixmapPtr       pixmap,
-			    RegionPtr       region,
-			    uxa_access_t    access)
+qxl_surface_begin_access (qxl_surface_t  *surface,
+			  RegionPtr       region,
+			  uxa_access_t    access)
 {
-    int n_boxes;
-    BoxPtr boxes;
-    ScreenPtr pScreen = pixmap->drawable.pScreen;
-    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     RegionRec new;
+    RegionRec stale;
 
-    if (!pScrn->vtSema)
-        return FALSE;
+    /* The upload worker may still be reading the host image */
+    qxl_upload_worker_wait (surface->qxl, surface->upload_seq);
+
+    if (!qxl_surface_ensure_host_image (surface))
+	return FALSE;
+
+    surface->last_access = GetTimeInMillis ();
 
     REGION_INIT (NULL, &new, (BoxPtr)NULL, 0);
     REGION_SUBTRACT (NULL, &new, region, &surface->access_region);
@@ -175,32 +538,60 @@ qxl_surface_prepare_access (qxl_surface_t  *surface,
 	surface->access_type = UXA_ACCESS_RW;
     
     region = &new;
-    
-    n_boxes = REGION_NUM_RECTS (region);
-    boxes = REGION_RECTS (region);
 
-    if (n_boxes < 25)
+    /* Nothing was rendered to the surface since all of the host image
+     * was valid, so there is no need to look at the tiles
+     */
+    if (surface->host_valid &&
+	surface->host_generation == surface->dev_generation)
     {
-	while (n_boxes--)
-	{
-	    qxl_download_box (surface, boxes->x1, boxes->y1, boxes->x2, boxes->y2);
-	    
-	    boxes++;
-	}
+	REGION_INIT (NULL, &stale, (BoxPtr)NULL, 0);
+    }
+    else if (stale_tiles (surface, region, &stale))
+    {
+	if (host_image_all_valid (surface))
+	    surface->host_generation = surface->dev_generation;
     }
     else
     {
-	qxl_download_box (
-	    surface,
-	    new.extents.x1, new.extents.y1, new.extents.x2, new.extents.y2);
+	REGION_INIT (NULL, &stale, (BoxPtr)NULL, 0);
+	REGION_COPY (NULL, &stale, region);
     }
+
+    download_region (surface, &stale);
+
+    REGION_UNINIT (NULL, &stale);
+
+    /* Start watching for writes only now, so the readback above
+     * doesn't count
+     */
+    if (access == UXA_ACCESS_RW && surface->qxl->track_writes)
+	qxl_track_begin (surface);
     
-    REGION_UNION (pScreen,
+    REGION_UNION (NULL,
 		  &(surface->access_region),
 		  &(surface->access_region),
 		      region);
     
     REGION_UNINIT (NULL, &new);
+
+    return TRUE;
+}
+
+Bool
+qxl_surface_prepare_access (qxl_surface_t  *surface,
+			    PixmapPtr       pixmap,
+			    RegionPtr       region,
+			    uxa_access_t    access)
+{
+    ScreenPtr pScreen = pixmap->drawable.pScreen;
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+
+    if (!pScrn->vtSema)
+        return FALSE;
+
+    if (!qxl_surface_begin_access (surface, region, access))
+	return FALSE;
     
     pScreen->ModifyPixmapHeader(
 	pixmap,
@@ -252,10 +643,34 @@ real_upload_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
 
     data = pixman_image_get_data (surface->host_image);
     stride = pixman_image_get_stride (surface->host_image);
-    
-    image_bo = qxl_image_create (
-	qxl, (const uint8_t *)data, x1, y1, x2 - x1, y2 - y1, stride, 
-	surface->bpp == 24 ? 4 : surface->bpp / 8, TRUE);
+    image_bo = NULL;
+
+#ifdef XSPICE
+    /* Software keeps writing to a surface it has RW access to, see
+     * upload_accessed(), so those pixels have to be copied. The host
+     * images of tiles point into the image of their tiled pixmap, which
+     * can't be copied on write like a host image of its own.
+     */
+    if (qxl->zero_copy_images && stride > 0 && !surface->tile &&
+	surface->access_type != UXA_ACCESS_RW)
+    {
+	image_bo = qxl_image_create_direct (
+	    qxl, surface->host_image, x1, y1, x2 - x1, y2 - y1,
+	    surface->bpp == 24 ? 4 : surface->bpp / 8);
+    }
+#endif
+    if (!image_bo && qxl->upload_worker)
+    {
+	image_bo = qxl_image_create_async (
+	    qxl, surface->host_image, x1, y1, x2 - x1, y2 - y1,
+	    surface->bpp == 24 ? 4 : surface->bpp / 8, &surface->upload_seq);
+    }
+    else if (!image_bo)
+    {
+	image_bo = qxl_image_create (
+	    qxl, (const uint8_t *)data, x1, y1, x2 - x1, y2 - y1, stride,
+	    surface->bpp == 24 ? 4 : surface->bpp / 8, TRUE);
+    }
     qxl->bo_funcs->bo_output_bo_reloc(qxl, offsetof(QXLDrawable, u.copy.src_bitmap),
 				   drawable_bo, image_bo);
     push_drawable (qxl, drawable_bo);
@@ -266,8 +681,8 @@ real_upload_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
 #define TILE_WIDTH 512
 #define TILE_HEIGHT 512
 
-void
-qxl_upload_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
+static void
+upload_box_tiled (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
 {
     int tile_x1, tile_y1;
 
@@ -288,6 +703,297 @@ qxl_upload_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
     }
 }
 
+static uint64_t
+hash_tile (pixman_image_t *image, int Bpp, int x1, int y1, int x2, int y2)
+{
+    const uint8_t *data = (const uint8_t *)pixman_image_get_data (image);
+    int stride = pixman_image_get_stride (image);
+    uint64_t hash = 0;
+    int y;
+
+    for (y = y1; y < y2; ++y)
+    {
+	uint64_t row[2];
+
+	MurmurHash3_x64_128 (data + y * stride + x1 * Bpp, (x2 - x1) * Bpp, y, row);
+
+	hash = (hash ^ row[0]) * 0x9e3779b97f4a7c15ULL + row[1];
+    }
+
+    return hash;
+}
+
+/* Large software rendered areas are frequently a single colour, for
+ * example cleared backgrounds. Tiles found to be uniform are sent as a
+ * solid fill instead of an image.
+ */
+static Bool
+row_is_uniform (const uint8_t *row, int len, const uint8_t *pattern)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i pat = _mm_loadu_si128 ((const __m128i *)pattern);
+
+    for (; i + 64 <= len; i += 64)
+    {
+	__m128i a = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)(row + i)), pat);
+	__m128i b = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)(row + i + 16)), pat);
+	__m128i c = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)(row + i + 32)), pat);
+	__m128i d = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)(row + i + 48)), pat);
+
+	a = _mm_and_si128 (_mm_and_si128 (a, b), _mm_and_si128 (c, d));
+	if (_mm_movemask_epi8 (a) != 0xffff)
+	    return FALSE;
+    }
+
+    for (; i + 16 <= len; i += 16)
+    {
+	__m128i a = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)(row + i)), pat);
+
+	if (_mm_movemask_epi8 (a) != 0xffff)
+	    return FALSE;
+    }
+#else
+    for (; i + 16 <= len; i += 16)
+    {
+	if (memcmp (row + i, pattern, 16) != 0)
+	    return FALSE;
+    }
+#endif
+
+    /* The pattern repeats the pixel, and i is a multiple of 16 bytes,
+     * so the tail starts on a pixel boundary.
+     */
+    return memcmp (row + i, pattern, len - i) == 0;
+}
+
+static Bool
+tile_is_uniform (pixman_image_t *image, int Bpp,
+		 int x1, int y1, int x2, int y2, uint32_t *pixel)
+{
+    const uint8_t *data = (const uint8_t *)pixman_image_get_data (image);
+    int stride = pixman_image_get_stride (image);
+    const uint8_t *first = data + y1 * stride + x1 * Bpp;
+    uint8_t pattern[16];
+    uint32_t p = 0;
+    int i, y;
+
+    for (i = 0; i < 16; i += Bpp)
+	memcpy (pattern + i, first, Bpp);
+
+    for (y = y1; y < y2; ++y)
+    {
+	if (!row_is_uniform (data + y * stride + x1 * Bpp, (x2 - x1) * Bpp, pattern))
+	    return FALSE;
+    }
+
+    switch (Bpp)
+    {
+    case 1:
+	p = *first;
+	break;
+    case 2:
+	p = *(const uint16_t *)first;
+	break;
+    case 4:
+	p = *(const uint32_t *)first;
+	break;
+    }
+
+    *pixel = p;
+    return TRUE;
+}
+
+typedef struct
+{
+    BoxRec	box;
+    uint32_t	pixel;
+} solid_run_t;
+
+void
+qxl_upload_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
+{
+    int Bpp = surface->bpp == 24 ? 4 : surface->bpp / 8;
+    int tile_x1, tile_x2, tile_y1, tile_y2;
+    BoxPtr runs;
+    int n_runs;
+    solid_run_t *solids;
+    int n_solids;
+    RegionRec dirty;
+    BoxPtr boxes;
+    int n_boxes;
+    int tx, ty, i;
+
+    if (x1 >= x2 || y1 >= y2)
+	return;
+
+    if (!ensure_tiles (surface))
+    {
+	upload_box_tiled (surface, x1, y1, x2, y2);
+	return;
+    }
+
+    tile_x1 = x1 / HASH_TILE_SIZE;
+    tile_y1 = y1 / HASH_TILE_SIZE;
+    tile_x2 = MIN ((x2 + HASH_TILE_SIZE - 1) / HASH_TILE_SIZE, surface->n_tiles_x);
+    tile_y2 = MIN ((y2 + HASH_TILE_SIZE - 1) / HASH_TILE_SIZE, surface->n_tiles_y);
+
+    runs = malloc ((tile_x2 - tile_x1) * (tile_y2 - tile_y1) * sizeof (BoxRec));
+    solids = malloc ((tile_x2 - tile_x1) * (tile_y2 - tile_y1) * sizeof (solid_run_t));
+    if (!runs || !solids)
+    {
+	free (runs);
+	free (solids);
+	upload_box_tiled (surface, x1, y1, x2, y2);
+	return;
+    }
+
+    /* Collect the tiles that changed as horizontal runs, split into
+     * runs of a single colour and runs that need an image. The region
+     * code merges the latter vertically.
+     */
+    n_runs = 0;
+    n_solids = 0;
+    for (ty = tile_y1; ty < tile_y2; ++ty)
+    {
+	int ry1 = MAX (ty * HASH_TILE_SIZE, y1);
+	int ry2 = MIN ((ty + 1) * HASH_TILE_SIZE, y2);
+	BoxPtr run = NULL;
+	solid_run_t *solid = NULL;
+
+	for (tx = tile_x1; tx < tile_x2; ++tx)
+	{
+	    int rx1 = MAX (tx * HASH_TILE_SIZE, x1);
+	    int rx2 = MIN ((tx + 1) * HASH_TILE_SIZE, x2);
+	    int tile = ty * surface->n_tiles_x + tx;
+	    Bool whole_tile;
+	    Bool changed = TRUE;
+	    Bool uniform;
+	    uint32_t pixel;
+
+	    whole_tile =
+		rx1 == tx * HASH_TILE_SIZE && ry1 == ty * HASH_TILE_SIZE &&
+		(rx2 == (tx + 1) * HASH_TILE_SIZE ||
+		 rx2 == pixman_image_get_width (surface->host_image)) &&
+		(ry2 == (ty + 1) * HASH_TILE_SIZE ||
+		 ry2 == pixman_image_get_height (surface->host_image));
+
+	    uniform = tile_is_uniform (surface->host_image, Bpp,
+				       rx1, ry1, rx2, ry2, &pixel);
+
+	    if (whole_tile && uniform)
+	    {
+		/* For solid tiles the colour is remembered instead of a
+		 * hash, so no hashing is needed.
+		 */
+		if (TILE_BIT_IS_SET (surface->tile_hashes_valid, tile) &&
+		    TILE_BIT_IS_SET (surface->tile_solid, tile) &&
+		    surface->tile_hashes[tile] == pixel)
+		{
+		    changed = FALSE;
+		}
+
+		surface->tile_hashes[tile] = pixel;
+		TILE_BIT_SET (surface->tile_hashes_valid, tile);
+		TILE_BIT_SET (surface->tile_solid, tile);
+	    }
+	    else if (whole_tile)
+	    {
+		uint64_t hash = hash_tile (surface->host_image, Bpp, rx1, ry1, rx2, ry2);
+
+		if (TILE_BIT_IS_SET (surface->tile_hashes_valid, tile) &&
+		    !TILE_BIT_IS_SET (surface->tile_solid, tile) &&
+		    surface->tile_hashes[tile] == hash)
+		{
+		    changed = FALSE;
+		}
+
+		surface->tile_hashes[tile] = hash;
+		TILE_BIT_SET (surface->tile_hashes_valid, tile);
+		TILE_BIT_CLEAR (surface->tile_solid, tile);
+	    }
+	    else
+	    {
+		/* Only part of the tile gets uploaded, so what the device
+		 * has there is no longer known.
+		 */
+		TILE_BIT_CLEAR (surface->tile_hashes_valid, tile);
+	    }
+
+	    if (!changed)
+	    {
+		run = NULL;
+		solid = NULL;
+	    }
+	    else if (uniform)
+	    {
+		run = NULL;
+
+		if (solid && solid->pixel == pixel)
+		{
+		    solid->box.x2 = rx2;
+		}
+		else
+		{
+		    solid = &solids[n_solids++];
+		    solid->box.x1 = rx1;
+		    solid->box.y1 = ry1;
+		    solid->box.x2 = rx2;
+		    solid->box.y2 = ry2;
+		    solid->pixel = pixel;
+		}
+	    }
+	    else if (run)
+	    {
+		solid = NULL;
+		run->x2 = rx2;
+	    }
+	    else
+	    {
+		solid = NULL;
+		run = &runs[n_runs++];
+		run->x1 = rx1;
+		run->y1 = ry1;
+		run->x2 = rx2;
+		run->y2 = ry2;
+	    }
+	}
+    }
+
+    for (i = 0; i < n_solids; ++i)
+    {
+	struct QXLRect qrect;
+
+	qrect.left = solids[i].box.x1;
+	qrect.top = solids[i].box.y1;
+	qrect.right = solids[i].box.x2;
+	qrect.bottom = solids[i].box.y2;
+
+	submit_fill (surface->qxl, surface, &qrect, solids[i].pixel);
+    }
+
+    if (n_runs)
+    {
+	pixman_region_init_rects (&dirty, runs, n_runs);
+
+	n_boxes = REGION_NUM_RECTS (&dirty);
+	boxes = REGION_RECTS (&dirty);
+
+	while (n_boxes--)
+	{
+	    upload_box_tiled (surface, boxes->x1, boxes->y1, boxes->x2, boxes->y2);
+
+	    boxes++;
+	}
+
+	pixman_region_fini (&dirty);
+    }
+
+    free (runs);
+    free (solids);
+}
+
 static void
 upload_one_primary_region(qxl_screen_t *qxl, PixmapPtr pixmap, BoxPtr b)
 {
@@ -306,6 +1012,9 @@ upload_one_primary_region(qxl_screen_t *qxl, PixmapPtr pixmap, BoxPtr b)
     rect.top = b->y1;
     rect.bottom = min(b->y2, qxl->virtual_y);
 
+    qxl_surface_invalidate_tiles (qxl->primary, rect.left, rect.top,
+				  rect.right, rect.bottom);
+
     drawable_bo = make_drawable (qxl, qxl->primary, QXL_DRAW_COPY, &rect);
     drawable = qxl->bo_funcs->bo_map(drawable_bo);
     drawable->u.copy.src_area = rect;
@@ -345,19 +1054,33 @@ qxl_surface_upload_primary_regions(qxl_screen_t *qxl, PixmapPtr pixmap, RegionRe
     }
 }
 
+/* Upload what software rendering wrote since qxl_surface_begin_access() */
 void
-qxl_surface_finish_access (qxl_surface_t *surface, PixmapPtr pixmap)
+qxl_surface_end_access (qxl_surface_t *surface)
 {
-    ScreenPtr pScreen = pixmap->drawable.pScreen;
-    int w = pixmap->drawable.width;
-    int h = pixmap->drawable.height;
     int n_boxes;
     BoxPtr boxes;
+    RegionRec dirty;
+    RegionPtr region = &surface->access_region;
+    uxa_access_t access = surface->access_type;
+
+    /* Only upload what software rendering actually wrote, if known */
+    REGION_INIT (NULL, &dirty, (BoxPtr)NULL, 0);
+    if (qxl_track_end (surface, &dirty))
+    {
+	REGION_INTERSECT (NULL, &dirty, &dirty, region);
+	region = &dirty;
+    }
 
-    n_boxes = REGION_NUM_RECTS (&surface->access_region);
-    boxes = REGION_RECTS (&surface->access_region);
+    n_boxes = REGION_NUM_RECTS (region);
+    boxes = REGION_RECTS (region);
 
-    if (surface->access_type == UXA_ACCESS_RW)
+    /* Software is done writing, so the uploads may use the host image
+     * directly
+     */
+    surface->access_type = UXA_ACCESS_RO;
+
+    if (access == UXA_ACCESS_RW && n_boxes)
     {
 	if (n_boxes < 25)
 	{
@@ -371,15 +1094,26 @@ qxl_surface_finish_access (qxl_surface_t *surface, PixmapPtr pixmap)
 	else
 	{
 	    qxl_upload_box (surface,
-			surface->access_region.extents.x1,
-			surface->access_region.extents.y1,
-			surface->access_region.extents.x2,
-			surface->access_region.extents.y2);
+			region->extents.x1,
+			region->extents.y1,
+			region->extents.x2,
+			region->extents.y2);
 	}
     }
 
-    REGION_EMPTY (pScreen, &surface->access_region);
-    surface->access_type = UXA_ACCESS_RO;
+    REGION_UNINIT (NULL, &dirty);
+
+    REGION_EMPTY (NULL, &surface->access_region);
+}
+
+void
+qxl_surface_finish_access (qxl_surface_t *surface, PixmapPtr pixmap)
+{
+    ScreenPtr pScreen = pixmap->drawable.pScreen;
+    int w = pixmap->drawable.width;
+    int h = pixmap->drawable.height;
+
+    qxl_surface_end_access (surface);
     
     pScreen->ModifyPixmapHeader(pixmap, w, h, -1, -1, 0, NULL);
 }
@@ -425,6 +1159,7 @@ qxl_surface_prepare_solid (qxl_surface_t *destination,
 #endif
     
     destination->u.solid_pixel = fg; //  ^ (rand() >> 16);
+    destination->last_use = GetTimeInMillis ();
 
     return TRUE;
 }
@@ -446,22 +1181,64 @@ qxl_surface_solid (qxl_surface_t *destination,
     qrect.right = x2;
 
     p = destination->u.solid_pixel;
-    
+
+    qxl_surface_invalidate_tiles (destination, x1, y1, x2, y2);
+
     submit_fill (qxl, destination, &qrect, p);
 }
 
 /* copy */
+
+/* The source of a copy may be accessed by software at the same time.
+ * What software may have written to the copied area is uploaded right
+ * before the copy, so the rest of the copy stays accelerated.
+ */
+static void
+upload_accessed (qxl_surface_t *surface, int x, int y, int width, int height)
+{
+    RegionRec r;
+    BoxRec box;
+    BoxPtr boxes;
+    int n_boxes;
+
+    if (surface->access_type != UXA_ACCESS_RW ||
+	REGION_NIL (&surface->access_region))
+    {
+	return;
+    }
+
+    box.x1 = x;
+    box.y1 = y;
+    box.x2 = x + width;
+    box.y2 = y + height;
+
+    REGION_INIT (NULL, &r, &box, 1);
+    REGION_INTERSECT (NULL, &r, &r, &surface->access_region);
+
+    n_boxes = REGION_NUM_RECTS (&r);
+    boxes = REGION_RECTS (&r);
+
+    while (n_boxes--)
+    {
+	qxl_upload_box (surface, boxes->x1, boxes->y1, boxes->x2, boxes->y2);
+	boxes++;
+    }
+
+    REGION_UNINIT (NULL, &r);
+}
+
 Bool
 qxl_surface_prepare_copy (qxl_surface_t *dest,
 			  qxl_surface_t *source)
 {
-    if (!REGION_NIL (&(dest->access_region))	||
-	!REGION_NIL (&(source->access_region)))
-    {
+    /* Software rendering to the destination would overwrite the copy
+     * in finish_access()
+     */
+    if (!REGION_NIL (&(dest->access_region)))
 	return FALSE;
-    }
 
     dest->u.copy_src = source;
+    dest->last_use = source->last_use = GetTimeInMillis ();
 
     return TRUE;
 }
@@ -513,7 +1290,12 @@ qxl_surface_copy (qxl_surface_t *dest,
     qrect.bottom = dest_y1 + height;
     qrect.left = dest_x1;
     qrect.right = dest_x1 + width;
-    
+
+    qxl_surface_invalidate_tiles (dest, qrect.left, qrect.top,
+				  qrect.right, qrect.bottom);
+
+    upload_accessed (dest->u.copy_src, src_x1, src_y1, width, height);
+
     if (dest->id == dest->u.copy_src->id)
     {
 	drawable_bo = make_drawable (qxl, dest, QXL_COPY_BITS, &qrect);
@@ -526,6 +1308,10 @@ qxl_surface_copy (qxl_surface_t *dest,
 	push_drawable (qxl, drawable_bo);
 
     }
+    else if (is_repeated_copy (dest, dest->u.copy_src, src_x1, src_y1, &qrect))
+    {
+	qxl->repeated_copies++;
+    }
     else
     {
 	struct qxl_bo *image_bo;
@@ -556,18 +1342,25 @@ qxl_surface_copy (qxl_surface_t *dest,
 	assert (src_x1 >= 0);
 	assert (src_y1 >= 0);
 
-	if (width > pixman_image_get_width (dest->u.copy_src->host_image))
+	if (width > pixman_image_get_width (dest->u.copy_src->dev_image))
 	{
 	    ErrorF ("dest w: %d   src w: %d\n",
-		    width, pixman_image_get_width (dest->u.copy_src->host_image));
+		    width, pixman_image_get_width (dest->u.copy_src->dev_image));
 	}
 	
-	assert (width <= pixman_image_get_width (dest->u.copy_src->host_image));
-	assert (height <= pixman_image_get_height (dest->u.copy_src->host_image));
+	assert (width <= pixman_image_get_width (dest->u.copy_src->dev_image));
+	assert (height <= pixman_image_get_height (dest->u.copy_src->dev_image));
 
 	qxl->bo_funcs->bo_unmap(drawable_bo);
 	push_drawable (qxl, drawable_bo);
 	qxl->bo_funcs->bo_decref(qxl, image_bo);
+
+	dest->last_draw.type = QXL_DRAW_COPY;
+	dest->last_draw.rect = qrect;
+	dest->last_draw.src = dest->u.copy_src;
+	dest->last_draw.src_serial = dest->u.copy_src->serial;
+	dest->last_draw.src_x = src_x1;
+	dest->last_draw.src_y = src_y1;
     }
 }
 
@@ -588,6 +1381,12 @@ qxl_surface_prepare_composite (int op,
     dest->u.composite.src = src;
     dest->u.composite.mask = mask;
     dest->u.composite.dest = dest;
+
+    dest->last_use = GetTimeInMillis ();
+    if (src)
+	src->last_use = dest->last_use;
+    if (mask)
+	mask->last_use = dest->last_use;
     
     return TRUE;
 }
@@ -634,8 +1433,8 @@ static QXLRect
 full_rect (qxl_surface_t *surface)
 {
     QXLRect r;
-    int w = pixman_image_get_width (surface->host_image);
-    int h = pixman_image_get_height (surface->host_image);
+    int w = pixman_image_get_width (surface->dev_image);
+    int h = pixman_image_get_height (surface->dev_image);
 	    
     r.left = r.top = 0;
     r.right = w;
@@ -644,6 +1443,57 @@ full_rect (qxl_surface_t *surface)
     return r;
 }
 
+/* The part of surface that compositing width x height pixels samples,
+ * when the top left pixel of the destination maps to (x, y) of the
+ * picture before its transform. It is sent as the dependency rectangle
+ * of the surface, so spice-server doesn't render more of it than the
+ * composite needs.
+ */
+static QXLRect
+sample_rect (qxl_surface_t *surface, PicturePtr picture,
+	     int x, int y, int width, int height)
+{
+    QXLRect full = full_rect (surface);
+    QXLRect r;
+    BoxRec box;
+
+    if (x < SHRT_MIN || y < SHRT_MIN ||
+	x + width > SHRT_MAX || y + height > SHRT_MAX)
+    {
+	return full;
+    }
+
+    box.x1 = x;
+    box.y1 = y;
+    box.x2 = x + width;
+    box.y2 = y + height;
+
+    if (picture->transform &&
+	!pixman_transform_bounds (picture->transform, &box))
+    {
+	return full;
+    }
+
+    /* Filters may look at the neighbouring pixels */
+    r.left = MAX (box.x1 - 1, full.left);
+    r.top = MAX (box.y1 - 1, full.top);
+    r.right = MIN (box.x2 + 1, full.right);
+    r.bottom = MIN (box.y2 + 1, full.bottom);
+
+    /* With repeat, pixels outside of the surface wrap around to
+     * anywhere in it
+     */
+    if (r.left >= r.right || r.top >= r.bottom ||
+	(picture->repeat &&
+	 (box.x1 < full.left || box.y1 < full.top ||
+	  box.x2 > full.right || box.y2 > full.bottom)))
+    {
+	return full;
+    }
+
+    return r;
+}
+
 void
 qxl_surface_composite (qxl_surface_t *dest,
 		       int src_x, int src_y,
@@ -685,7 +1535,10 @@ qxl_surface_composite (qxl_surface_t *dest,
     rect.right = dest_x + width;
     rect.top = dest_y;
     rect.bottom = dest_y + height;
-    
+
+    qxl_surface_invalidate_tiles (dest, rect.left, rect.top,
+				  rect.right, rect.bottom);
+
     drawable_bo = make_drawable (qxl, dest, QXL_DRAW_COMPOSITE, &rect);
 
     drawable = qxl->bo_funcs->bo_map(drawable_bo);
@@ -717,7 +1570,8 @@ qxl_surface_composite (qxl_surface_t *dest,
 	composite->src_transform = 0;
 
     qxl->bo_funcs->bo_output_surf_reloc(qxl, offsetof(struct QXLDrawable, surfaces_dest[n_deps]), drawable_bo, qsrc);
-    drawable->surfaces_rects[n_deps] = full_rect (qsrc);
+    drawable->surfaces_rects[n_deps] =
+	sample_rect (qsrc, src, src_x, src_y, width, height);
 
     n_deps++;
     
@@ -735,10 +1589,11 @@ qxl_surface_composite (qxl_surface_t *dest,
 	composite->flags |= (mask->componentAlpha << 18);
 
 	qxl->bo_funcs->bo_output_surf_reloc(qxl, offsetof(struct QXLDrawable, surfaces_dest[n_deps]), drawable_bo, qmask);
-	drawable->surfaces_rects[n_deps] = full_rect (qmask);
+	drawable->surfaces_rects[n_deps] =
+	    sample_rect (qmask, mask, mask_x, mask_y, width, height);
 	n_deps++;
 	
-	trans_bo = get_transform (qxl, src->transform);
+	trans_bo = get_transform (qxl, mask->transform);
 	if (trans_bo) {
 	    qxl->bo_funcs->bo_output_bo_reloc(qxl, offsetof(QXLDrawable, u.composite.mask_transform),
 					   drawable_bo, trans_bo);
@@ -754,7 +1609,7 @@ qxl_surface_composite (qxl_surface_t *dest,
     }
 
     qxl->bo_funcs->bo_output_surf_reloc(qxl, offsetof(struct QXLDrawable, surfaces_dest[n_deps]), drawable_bo, dest);
-    drawable->surfaces_rects[n_deps] = full_rect (dest);
+    drawable->surfaces_rects[n_deps] = rect;
     
     composite->src_origin.x = src_x;
     composite->src_origin.y = src_y;
@@ -786,6 +1641,10 @@ qxl_surface_put_image (qxl_surface_t *dest,
     rect.top = y;
     rect.bottom = y + height;
 
+    qxl_surface_invalidate_tiles (dest, rect.left, rect.top,
+				  rect.right, rect.bottom);
+    dest->last_use = GetTimeInMillis ();
+
     drawable_bo = make_drawable (qxl, dest, QXL_DRAW_COPY, &rect);
 
     drawable = qxl->bo_funcs->bo_map(drawable_bo);
@@ -30,6 +30,13 @@ struct qxl_surface_t
 
     struct evacuated_surface_t *evacuated;
 
+    /* Links for the surface cache, only used while the surface is in it */
+    struct qxl_surface_t *	bucket_next;
+    struct qxl_surface_t *	bucket_prev;
+    struct qxl_surface_t *	lru_next;
+    struct qxl_surface_t *	lru_prev;
+    int				size_class;
+
     union
     {
 	struct qxl_surface_t *copy_src;
@@ -47,9 +54,86 @@ struct qxl_surface_t
 	} composite;
     } u;
     struct qxl_bo *image_bo;
+
+    /* Content hashes of what was last uploaded for each tile of the
+     * upload grid, see qxl_upload_box(). For tiles marked in tile_solid
+     * the "hash" is the fill colour.
+     */
+    uint64_t *		tile_hashes;
+    uint32_t *		tile_hashes_valid;
+    uint32_t *		tile_solid;
+
+    /* Tiles of host_image that hold the current device content, see
+     * qxl_surface_prepare_access()
+     */
+    uint32_t *		host_valid;
+    int			n_tiles_x;
+    int			n_tiles_y;
+
+    /* dev_generation counts rendering commands sent to the surface.
+     * host_generation is its value when all of host_image was last
+     * known to be valid.
+     */
+    uint32_t		dev_generation;
+    uint32_t		host_generation;
+
+    /* host_image was created by qxl_track_create_image() */
+    Bool		host_image_trackable;
+
+    /* The surface is a tile of a tiled pixmap, and host_image points
+     * into the image of the pixmap, see qxl_tiled.c
+     */
+    Bool		tile;
+
+    /* Usage hint of the pixmap the surface was created for, see
+     * qxl_placement.c
+     */
+    int			usage_class;
+
+    /* Last upload job reading from host_image, see qxl_upload.c */
+    uint32_t		upload_seq;
+
+    /* Time of the last software access, used to release idle host
+     * images, see qxl_surface_ums.c
+     */
+    CARD32		last_access;
+
+    /* Time the device last drew to or from the surface, used to pick
+     * surfaces to move to system memory
+     */
+    CARD32		last_use;
+
+    /* The last fill or copy sent to the surface, as long as nothing was
+     * drawn over it since, and a serial number that changes with every
+     * drawing command, see qxl_surface.c
+     */
+    struct
+    {
+	uint8_t			type;		/* 0 if none */
+	struct QXLRect		rect;
+	uint32_t		color;
+	struct qxl_surface_t *	src;
+	uint32_t		src_serial;
+	int			src_x;
+	int			src_y;
+    } last_draw;
+    uint32_t		serial;
+
+    /* Recent accelerated operations and software accesses, halved on
+     * every tick of the spill timer, see qxl_surface_ums.c
+     */
+    unsigned int	accel_ops;
+    unsigned int	sw_accesses;
+
+    /* Times the pixmap of the surface was demoted to system memory */
+    unsigned int	demotions;
 };
 
 void qxl_download_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2);
 void qxl_upload_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2);
+void qxl_surface_invalidate_tiles (qxl_surface_t *surface,
+				   int x1, int y1, int x2, int y2);
+void qxl_surface_free_tiles (qxl_surface_t *surface);
+void qxl_surface_forget_draws (qxl_surface_t *surface);
 
 #endif
@@ -59,7 +59,9 @@ typedef struct evacuated_surface_t evacuated_surface_t;
 
 struct evacuated_surface_t
 {
+    /* The contents are packed, unless packing failed */
     pixman_image_t	*image;
+    qxl_packed_image_t	*packed;
     PixmapPtr		 pixmap;
     int			 bpp;
 
@@ -67,7 +69,45 @@ struct evacuated_surface_t
     evacuated_surface_t *next;
 };
 
-#define N_CACHED_SURFACES 64
+struct qxl_spilled_pixmap
+{
+    PixmapPtr		 pixmap;
+    pixman_image_t	*image;
+    int			 bpp;
+
+    /* Pixmaps evacuated but not restored yet have no image, only this */
+    qxl_packed_image_t	*packed;
+
+    /* Still to be moved back by the restore timer, with or without an
+     * image
+     */
+    Bool		 restore;
+
+    /* Times UXA looked at the pixmap since the last spill timer tick */
+    unsigned int	 uses;
+    CARD32		 spilled_at;
+
+    /* Moved out because software kept accessing it, not to make room,
+     * and how many times that happened to the pixmap
+     */
+    Bool		 demoted;
+    unsigned int	 demotions;
+
+    qxl_spilled_pixmap_t *prev;
+    qxl_spilled_pixmap_t *next;
+};
+
+/* Cached surfaces keep their video memory and their surface id, so the
+ * cache holds at most this fraction of either, see
+ * qxl_surface_cache_create()
+ */
+#define CACHE_SHARE 4
+
+/* Cached surfaces are kept in buckets by bpp and by the log2 of their
+ * area, so a lookup only looks at surfaces of about the right size.
+ */
+#define N_BPP_CLASSES 4
+#define N_SIZE_CLASSES 32
 
 /*
  * Surface cache
@@ -87,12 +127,59 @@ struct surface_cache_t
     /* All surfaces that need to be allocated (linked through next, but not prev) */
     qxl_surface_t *free_surfaces;
 
-    /* Surfaces that are already allocated, but not in used by the driver,
-     * linked through next
+    /* Surfaces that are already allocated, but not in used by the driver.
+     * Each one is in a size bucket (linked through bucket_next/prev) and
+     * in the LRU list (linked through lru_next/prev), newest first.
      */
-    qxl_surface_t *cached_surfaces[N_CACHED_SURFACES];
+    qxl_surface_t *buckets[N_BPP_CLASSES][N_SIZE_CLASSES];
+    qxl_surface_t *lru_head;
+    qxl_surface_t *lru_tail;
+    int n_cached;
+    int max_cached;
+    unsigned long cached_bytes;
+    unsigned long max_cached_bytes;
+
+    /* Releases host images that software hasn't accessed for a while.
+     * It only runs while some off-screen surface has one.
+     */
+    OsTimerPtr host_image_timer;
+    Bool host_image_timer_armed;
+
+    /* Pixmaps whose surface was moved to system memory, and the timer
+     * that moves surfaces back and forth. vram_wanted is the size of
+     * the last surface allocation that failed, if any.
+     */
+    qxl_spilled_pixmap_t *spilled;
+    OsTimerPtr spill_timer;
+    unsigned long vram_wanted;
+
+    /* Restores evacuated pixmaps nobody asked for yet */
+    OsTimerPtr restore_timer;
+
+    /* Statistics */
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long long wasted_bytes;
+    unsigned long host_image_allocs;
+    unsigned long host_image_unshares;
+    unsigned long host_image_releases;
+    unsigned long spills;
+    unsigned long promotions;
+    unsigned long demotions;
+    unsigned long restores;
 };
 
+#define SPILL_INTERVAL 1000
+#define RESTORE_INTERVAL 20
+
+static CARD32 spill_timer_callback (OsTimerPtr timer, CARD32 now, pointer arg);
+static CARD32 restore_timer_callback (OsTimerPtr timer, CARD32 now, pointer arg);
+static void queue_restore (surface_cache_t *cache, evacuated_surface_t *ev);
+static CARD32 host_image_timer_callback (OsTimerPtr timer, CARD32 now, pointer arg);
+static Bool restore_pixmap (surface_cache_t *cache, qxl_spilled_pixmap_t *spilled);
+static Bool unpack_pixmap (surface_cache_t *cache, qxl_spilled_pixmap_t *spilled);
+
 #ifdef DEBUG_SURFACE_LIFECYCLE
 static void debug_surface_open(void)
 {
@@ -131,24 +218,23 @@ static void debug_surface_log(surface_cache_t *cache)
 #endif
 
 
-static Bool
+/* all_surfaces is allocated with the cache and not freed when
+ * evacuating, since surfaces are still tied to pixmaps that may be
+ * destroyed after evacuation before recreation. So resetting the cache
+ * can't fail.
+ */
+static void
 surface_cache_init (surface_cache_t *cache, qxl_screen_t *qxl)
 {
     int n_surfaces = qxl->rom->n_surfaces;
     int i;
 
-    if (!cache->all_surfaces)
-    {
-        /* all_surfaces is not freed when evacuating, since surfaces are still
-         * tied to pixmaps that may be destroyed after evacuation before
-         * recreation */
-        cache->all_surfaces = calloc (n_surfaces, sizeof (qxl_surface_t));
-        if (!cache->all_surfaces)
-            return FALSE;
-    }
-
     memset (cache->all_surfaces, 0, n_surfaces * sizeof (qxl_surface_t));
-    memset (cache->cached_surfaces, 0, N_CACHED_SURFACES * sizeof (qxl_surface_t *));
+    memset (cache->buckets, 0, sizeof (cache->buckets));
+    cache->lru_head = NULL;
+    cache->lru_tail = NULL;
+    cache->n_cached = 0;
+    cache->cached_bytes = 0;
     
     cache->free_surfaces = NULL;
     cache->live_surfaces = NULL;
@@ -173,10 +259,217 @@ surface_cache_init (surface_cache_t *cache, qxl_screen_t *qxl)
 	    cache->all_surfaces[i].in_use = FALSE;
 	}
     }
+}
+
+/* The host image of an off-screen surface is a system memory copy that
+ * is only needed while software rendering accesses the surface. It is
+ * allocated on first access, and released again once it hasn't been
+ * accessed for host_image_idle_timeout seconds, or when the surface is
+ * put in the cache. Everything in it has been uploaded by then, so the
+ * device holds the only copy needed.
+ *
+ * The primary surface always keeps its host image, since it backs the
+ * screen pixmap.
+ */
+static int
+surface_image_size (qxl_surface_t *surface)
+{
+    return abs (pixman_image_get_stride (surface->dev_image)) *
+	pixman_image_get_height (surface->dev_image);
+}
+
+static int
+surface_vram_size (qxl_surface_t *surface)
+{
+    /* See surface_send_create() */
+    return surface_image_size (surface) +
+	abs (pixman_image_get_stride (surface->dev_image));
+}
+
+static int
+align (int x, int alignment)
+{
+    return (x + alignment - 1) & ~(alignment - 1);
+}
+
+static void
+free_bits (pixman_image_t *image, void *data)
+{
+    free (data);
+}
+
+/* Host images get the same row alignment as the surfaces, so copies
+ * between the two are aligned on both sides
+ */
+static pixman_image_t *
+create_aligned_image (pixman_format_code_t format, int width, int height,
+		      int alignment)
+{
+    int stride = ((width * PIXMAN_FORMAT_BPP (format) + 31) / 32) * 4;
+    pixman_image_t *image;
+    void *bits;
+
+    if (alignment <= 4)
+	return pixman_image_create_bits (format, width, height, NULL, -1);
+
+    stride = align (stride, alignment);
+
+    if (posix_memalign (&bits, alignment, (size_t)stride * height) != 0)
+	return NULL;
+
+    image = pixman_image_create_bits (format, width, height, bits, stride);
+    if (!image)
+    {
+	free (bits);
+	return NULL;
+    }
+
+    pixman_image_set_destroy_function (image, free_bits, bits);
+
+    return image;
+}
+
+static Bool
+alloc_host_image (qxl_surface_t *surface)
+{
+    pixman_format_code_t format;
+    int width, height;
+
+    format = pixman_image_get_format (surface->dev_image);
+    width = pixman_image_get_width (surface->dev_image);
+    height = pixman_image_get_height (surface->dev_image);
+
+    if (surface->qxl->track_writes)
+    {
+	surface->host_image = qxl_track_create_image (format, width, height);
+	surface->host_image_trackable = (surface->host_image != NULL);
+    }
+
+    if (!surface->host_image)
+    {
+	surface->host_image = create_aligned_image (
+	    format, width, height, surface->qxl->surface_stride_align);
+	surface->host_image_trackable = FALSE;
+    }
+
+    return surface->host_image != NULL;
+}
+
+/* Direct image commands may still read the host image, so software
+ * gets a copy of it instead
+ */
+static Bool
+unshare_host_image (qxl_surface_t *surface)
+{
+    pixman_image_t *pinned = surface->host_image;
+    Bool trackable = surface->host_image_trackable;
+
+    surface->host_image = NULL;
+    if (!alloc_host_image (surface))
+    {
+	surface->host_image = pinned;
+	surface->host_image_trackable = trackable;
+	return FALSE;
+    }
+
+    pixman_image_composite (PIXMAN_OP_SRC, pinned, NULL, surface->host_image,
+			    0, 0, 0, 0, 0, 0,
+			    pixman_image_get_width (pinned),
+			    pixman_image_get_height (pinned));
+    pixman_image_unref (pinned);
+
+    surface->cache->host_image_unshares++;
+
+    return TRUE;
+}
+
+static void
+arm_host_image_timer (surface_cache_t *cache)
+{
+    CARD32 timeout = cache->qxl->host_image_idle_timeout * 1000;
+
+    if (!timeout || cache->host_image_timer_armed)
+	return;
+
+    cache->host_image_timer = TimerSet (cache->host_image_timer, 0, timeout,
+					host_image_timer_callback, cache);
+    cache->host_image_timer_armed = (cache->host_image_timer != NULL);
+}
+
+/* Make sure the surface has a host image that software may write to */
+Bool
+qxl_surface_ensure_host_image (qxl_surface_t *surface)
+{
+    if (surface->host_image)
+    {
+	if (qxl_image_is_pinned (surface->qxl, surface->host_image))
+	    return unshare_host_image (surface);
+
+	return TRUE;
+    }
+
+    if (!alloc_host_image (surface))
+	return FALSE;
+
+    /* Nothing has been read back into the new image yet */
+    if (surface->host_valid)
+    {
+	memset (surface->host_valid, 0,
+		(surface->n_tiles_x * surface->n_tiles_y + 31) / 32 * sizeof (uint32_t));
+    }
+    surface->host_generation = surface->dev_generation - 1;
+
+    surface->cache->host_image_allocs++;
+
+    if (surface->id != 0 && !surface->tile)
+	arm_host_image_timer (surface->cache);
 
     return TRUE;
 }
 
+static void
+release_host_image (qxl_surface_t *surface)
+{
+    if (!surface->host_image || surface->id == 0 || surface->tile ||
+	REGION_NOTEMPTY (NULL, &surface->access_region))
+    {
+	return;
+    }
+
+    /* A pending upload job holds its own reference */
+    pixman_image_unref (surface->host_image);
+    surface->host_image = NULL;
+    surface->host_image_trackable = FALSE;
+
+    surface->cache->host_image_releases++;
+}
+
+static CARD32
+host_image_timer_callback (OsTimerPtr timer, CARD32 now, pointer arg)
+{
+    surface_cache_t *cache = arg;
+    CARD32 timeout = cache->qxl->host_image_idle_timeout * 1000;
+    Bool releasable = FALSE;
+    qxl_surface_t *s;
+
+    for (s = cache->live_surfaces; s != NULL; s = s->next)
+    {
+	if (s->host_image && now - s->last_access >= timeout)
+	    release_host_image (s);
+
+	if (s->host_image && s->id != 0 && !s->tile)
+	    releasable = TRUE;
+    }
+
+    if (releasable)
+	return timeout;
+
+    /* Armed again by the next host image allocation */
+    cache->host_image_timer_armed = FALSE;
+
+    return 0;
+}
+
 surface_cache_t *
 qxl_surface_cache_create (qxl_screen_t *qxl)
 {
@@ -187,15 +480,50 @@ qxl_surface_cache_create (qxl_screen_t *qxl)
 
     memset(cache, 0, sizeof(*cache));
     cache->qxl = qxl;
-    if (!surface_cache_init (cache, qxl))
+    cache->all_surfaces = calloc (qxl->rom->n_surfaces, sizeof (qxl_surface_t));
+    if (!cache->all_surfaces)
     {
 	free (cache);
 	return NULL;
     }
 
+    surface_cache_init (cache, qxl);
+
+    cache->max_cached = qxl->rom->n_surfaces / CACHE_SHARE;
+    cache->max_cached_bytes = qxl->vram_size / CACHE_SHARE;
+
+    if (qxl->spill_surfaces || qxl->migrate_pixmaps)
+    {
+	cache->spill_timer =
+	    TimerSet (NULL, 0, SPILL_INTERVAL, spill_timer_callback, cache);
+    }
+
     return cache;
 }
 
+void
+qxl_surface_cache_fini (surface_cache_t *cache)
+{
+    if (cache->host_image_timer)
+    {
+	TimerFree (cache->host_image_timer);
+	cache->host_image_timer = NULL;
+	cache->host_image_timer_armed = FALSE;
+    }
+
+    if (cache->spill_timer)
+    {
+	TimerFree (cache->spill_timer);
+	cache->spill_timer = NULL;
+    }
+
+    if (cache->restore_timer)
+    {
+	TimerFree (cache->restore_timer);
+	cache->restore_timer = NULL;
+    }
+}
+
 void
 qxl_surface_cache_sanity_check (surface_cache_t *qxl)
 {
@@ -217,50 +545,189 @@ qxl_surface_cache_sanity_check (surface_cache_t *qxl)
 #endif
 }
 
+void
+qxl_surface_cache_dump_stats (surface_cache_t *cache)
+{
+    unsigned long long host_bytes = 0, saved_bytes = 0;
+    qxl_surface_t *s;
+
+    ErrorF ("Surface cache: %d cached (%lu bytes), %lu hits, %lu misses, "
+	    "%lu evictions, %llu bytes wasted on oversized hits\n",
+	    cache->n_cached, cache->cached_bytes, cache->hits, cache->misses,
+	    cache->evictions, cache->wasted_bytes);
+
+    for (s = cache->live_surfaces; s != NULL; s = s->next)
+    {
+	if (s->host_image)
+	    host_bytes += surface_image_size (s);
+	else
+	    saved_bytes += surface_image_size (s);
+    }
+
+    for (s = cache->lru_head; s != NULL; s = s->lru_next)
+	saved_bytes += surface_image_size (s);
+
+    ErrorF ("Host images: %llu KB allocated, %llu KB saved, "
+	    "%lu allocations, %lu releases, %lu copied for writing\n",
+	    host_bytes >> 10, saved_bytes >> 10,
+	    cache->host_image_allocs, cache->host_image_releases,
+	    cache->host_image_unshares);
+
+    if (cache->qxl->spill_surfaces || cache->qxl->migrate_pixmaps ||
+	cache->restores)
+    {
+	qxl_spilled_pixmap_t *spilled;
+	int n_spilled = 0, n_packed = 0;
+
+	for (spilled = cache->spilled; spilled != NULL; spilled = spilled->next)
+	{
+	    if (spilled->image)
+		n_spilled++;
+	    else
+		n_packed++;
+	}
+
+	ErrorF ("Spilled surfaces: %d in system memory, %d still packed, "
+		"%lu spills, %lu demotions, %lu promotions, %lu restores\n",
+		n_spilled, n_packed, cache->spills, cache->demotions,
+		cache->promotions, cache->restores);
+    }
+}
+
 static void
 print_cache_info (surface_cache_t *cache)
 {
-    int i;
-    int n_surfaces = 0;
+    qxl_surface_t *s;
 
     ErrorF ("Cache contents:  ");
-    for (i = 0; i < N_CACHED_SURFACES; ++i)
+    for (s = cache->lru_head; s != NULL; s = s->lru_next)
+	ErrorF ("%4d ", s->id);
+
+    ErrorF ("    total: %d\n", cache->n_cached);
+
+    qxl_surface_cache_dump_stats (cache);
+}
+
+static int
+bpp_class (int bpp)
+{
+    switch (bpp)
     {
-	if (cache->cached_surfaces[i])
-	{
-	    ErrorF ("%4d ", cache->cached_surfaces[i]->id);
-	    n_surfaces++;
-	}
-	else
-	    ErrorF ("null ");
+    case 8:
+	return 0;
+    case 16:
+	return 1;
+    case 24:
+	return 2;
+    default:
+	return 3;
     }
+}
+
+static int
+size_class (unsigned long area)
+{
+    int class = 0;
+
+    while (area >>= 1)
+	class++;
+
+    return MIN (class, N_SIZE_CLASSES - 1);
+}
+
+static void
+cache_insert (surface_cache_t *cache, qxl_surface_t *surface)
+{
+    int w = pixman_image_get_width (surface->dev_image);
+    int h = pixman_image_get_height (surface->dev_image);
+    qxl_surface_t **bucket;
+
+    surface->size_class = size_class ((unsigned long)w * h);
+    bucket = &cache->buckets[bpp_class (surface->bpp)][surface->size_class];
+
+    surface->bucket_prev = NULL;
+    surface->bucket_next = *bucket;
+    if (*bucket)
+	(*bucket)->bucket_prev = surface;
+    *bucket = surface;
+
+    surface->lru_prev = NULL;
+    surface->lru_next = cache->lru_head;
+    if (cache->lru_head)
+	cache->lru_head->lru_prev = surface;
+    else
+	cache->lru_tail = surface;
+    cache->lru_head = surface;
+
+    cache->n_cached++;
+    cache->cached_bytes += surface_vram_size (surface);
+}
+
+static void
+cache_remove (surface_cache_t *cache, qxl_surface_t *surface)
+{
+    if (surface->bucket_prev)
+	surface->bucket_prev->bucket_next = surface->bucket_next;
+    else
+	cache->buckets[bpp_class (surface->bpp)][surface->size_class] = surface->bucket_next;
+    if (surface->bucket_next)
+	surface->bucket_next->bucket_prev = surface->bucket_prev;
+
+    if (surface->lru_prev)
+	surface->lru_prev->lru_next = surface->lru_next;
+    else
+	cache->lru_head = surface->lru_next;
+    if (surface->lru_next)
+	surface->lru_next->lru_prev = surface->lru_prev;
+    else
+	cache->lru_tail = surface->lru_prev;
+
+    surface->bucket_prev = surface->bucket_next = NULL;
+    surface->lru_prev = surface->lru_next = NULL;
 
-    ErrorF ("    total: %d\n", n_surfaces);
+    cache->n_cached--;
+    cache->cached_bytes -= surface_vram_size (surface);
 }
 
+/* A cached surface is only reused if it is at least as large as requested
+ * in both dimensions, and its area exceeds the requested one by no more
+ * than the configured fit ratio. Only the size classes that can hold such
+ * surfaces are searched.
+ */
 static qxl_surface_t *
 surface_get_from_cache (surface_cache_t *cache, int width, int height, int bpp)
 {
-    int i;
+    unsigned long area = (unsigned long)width * height;
+    unsigned long max_area = area * cache->qxl->surface_cache_fit_ratio / 100;
+    int class, last_class;
 
-    for (i = 0; i < N_CACHED_SURFACES; ++i)
+    last_class = size_class (max_area);
+
+    for (class = size_class (area); class <= last_class; ++class)
     {
-	qxl_surface_t *s = cache->cached_surfaces[i];
+	qxl_surface_t *s;
 
-	if (s && bpp == s->bpp)
+	for (s = cache->buckets[bpp_class (bpp)][class]; s != NULL; s = s->bucket_next)
 	{
-	    int w = pixman_image_get_width (s->host_image);
-	    int h = pixman_image_get_height (s->host_image);
-	    
-	    if (width <= w && width * 4 > w && height <= h && height * 4 > h)
+	    int w = pixman_image_get_width (s->dev_image);
+	    int h = pixman_image_get_height (s->dev_image);
+
+	    if (s->bpp == bpp && width <= w && height <= h &&
+		(unsigned long)w * h <= max_area)
 	    {
-		cache->cached_surfaces[i] = NULL;
+		cache_remove (cache, s);
+
+		cache->hits++;
+		cache->wasted_bytes +=
+		    ((unsigned long)w * h - area) * (bpp == 24 ? 4 : bpp / 8);
 
 		return s;
 	    }
 	}
     }
 
+    cache->misses++;
+
     return NULL;
 }
 
@@ -275,6 +742,15 @@ qxl_surface_recycle (surface_cache_t *cache, uint32_t id)
     if (surface->bo)
 	cache->qxl->bo_funcs->bo_decref (cache->qxl, surface->bo);
     surface->bo = NULL;
+
+#ifdef DEBUG_SURFACE_FREE_LIST
+    /* A surface that is not in use is already on the free list */
+    if (!surface->in_use)
+	ErrorF ("huh: %d recycled twice\n", surface->id);
+    assert (surface->in_use);
+#endif
+
+    surface->in_use = FALSE;
     surface->next = cache->free_surfaces;
     cache->free_surfaces = surface;
 }
@@ -330,10 +806,11 @@ qxl_surface_cache_create_primary (qxl_screen_t *qxl,
     memset(qxl->fb, 0, mode->stride * mode->y_res);
 #endif
 
-    surface = malloc (sizeof *surface);
+    surface = calloc (1, sizeof *surface);
     surface->id = 0;
     surface->dev_image = dev_image;
     surface->host_image = host_image;
+    surface->host_image_trackable = FALSE;
     surface->cache = cache;
     surface->qxl = qxl;
     surface->bpp = mode->bits;
@@ -342,6 +819,16 @@ qxl_surface_cache_create_primary (qxl_screen_t *qxl,
     surface->evacuated = NULL;
     surface->bo = bo;
     surface->image_bo = NULL;
+    surface->tile_hashes = NULL;
+    surface->tile_hashes_valid = NULL;
+    surface->tile_solid = NULL;
+    surface->host_valid = NULL;
+    surface->n_tiles_x = 0;
+    surface->n_tiles_y = 0;
+    surface->dev_generation = 0;
+    surface->host_generation = 0;
+    surface->upload_seq = 0;
+    qxl_surface_forget_draws (surface);
     
     REGION_INIT (NULL, &(surface->access_region), (BoxPtr)NULL, 0);
     surface->access_type = UXA_ACCESS_RO;
@@ -395,35 +882,26 @@ surface_get_from_free_list (surface_cache_t *cache)
 
     if (cache->free_surfaces)
     {
-	qxl_surface_t *s;
-
 	result = cache->free_surfaces;
 	cache->free_surfaces = cache->free_surfaces->next;
 
+#ifdef DEBUG_SURFACE_FREE_LIST
+	/* Surfaces only get on the free list through qxl_surface_recycle(),
+	 * which refuses ones that are not in use, so no duplicates can
+	 * exist if this holds.
+	 */
+	assert (!result->in_use);
+#endif
+
 	result->next = NULL;
 	result->in_use = TRUE;
 	result->ref_count = 1;
 	result->pixmap = NULL;
-
-	for (s = cache->free_surfaces; s; s = s->next)
-	{
-	    if (s->id == result->id)
-		ErrorF ("huh: %d to be returned, but %d is in list\n",
-			s->id, result->id);
-
-	    assert (s->id != result->id);
-	}
     }
     
     return result;
 }
 
-static int
-align (int x)
-{
-    return x;
-}
-
 static qxl_surface_t *
 surface_send_create (surface_cache_t *cache,
 		     int	      width,
@@ -442,11 +920,9 @@ surface_send_create (surface_cache_t *cache,
     void *dev_ptr;
     qxl_get_formats (bpp, &format, &pformat);
     
-    width = align (width);
-    height = align (height);
-    
     stride = width * PIXMAN_FORMAT_BPP (pformat) / 8;
-    stride = (stride + 3) & ~3;
+    if (qxl->surface_stride_align)
+	stride = align (stride, qxl->surface_stride_align);
 
     /* the final + stride is to work around a bug where the device apparently 
      * scribbles after the end of the image
@@ -474,6 +950,9 @@ retry2:
 
 	ErrorF ("Out of video memory: Could not allocate %d bytes\n",
 		stride * height + stride);
+
+	/* Make room for next time */
+	cache->vram_wanted = MAX (cache->vram_wanted, stride * height + stride);
 	
 	return NULL;
     }
@@ -514,8 +993,12 @@ retry:
     surface->dev_image = pixman_image_create_bits (
 	pformat, width, height, dev_addr, - stride);
 
-    surface->host_image = pixman_image_create_bits (
-	pformat, width, height, NULL, -1);
+    /* The contents of the new surface are undefined */
+    qxl_surface_forget_draws (surface);
+
+    /* The host image is allocated on first access */
+    surface->host_image = NULL;
+    surface->host_image_trackable = FALSE;
 
     qxl->bo_funcs->bo_unmap(surface->bo);
     surface->bpp = bpp;
@@ -573,6 +1056,11 @@ qxl_surface_create (qxl_screen_t *qxl,
 	if (!(surface = surface_send_create (cache, width, height, bpp)))
 	    return NULL;
 
+    surface->last_use = GetTimeInMillis ();
+    surface->accel_ops = 0;
+    surface->sw_accesses = 0;
+    surface->demotions = 0;
+
     surface->next = cache->live_surfaces;
     surface->prev = NULL;
     if (cache->live_surfaces)
@@ -622,6 +1110,8 @@ surface_destroy (qxl_surface_t *surface)
     if (surface->host_image)
 	pixman_image_unref (surface->host_image);
 
+    qxl_surface_free_tiles (surface);
+
 #if 0
     ErrorF("destroy %ld\n", (long int)surface->end - (long int)surface->address);
 #endif
@@ -636,70 +1126,41 @@ static void
 surface_add_to_cache (qxl_surface_t *surface)
 {
     surface_cache_t *cache = surface->cache;
-    int oldest = -1;
-    int n_surfaces = 0;
-    int i, delta;
-    int destroy_id = -1;
-    qxl_surface_t *destroy_surface = NULL;
+    unsigned long size = surface_vram_size (surface);
+    qxl_surface_t *destroy_surfaces = NULL;
 
     surface->ref_count++;
-    
-    for (i = 0; i < N_CACHED_SURFACES; ++i)
-    {
-	if (cache->cached_surfaces[i])
-	{
-	    oldest = i;
-	    n_surfaces++;
-	}
-    }
-    
-    if (n_surfaces == N_CACHED_SURFACES)
-    {
-	destroy_id = cache->cached_surfaces[oldest]->id;
-	
-	destroy_surface = cache->cached_surfaces[oldest];
-	
-	cache->cached_surfaces[oldest] = NULL;
-	
-	for (i = 0; i < N_CACHED_SURFACES; ++i)
-	    assert (!cache->cached_surfaces[i] ||
-		    cache->cached_surfaces[i]->id != destroy_id);
-    }
-    
-    delta = 0;
-    for (i = N_CACHED_SURFACES - 1; i >= 0; i--)
+
+    /* The content of a cached surface is never read again */
+    release_host_image (surface);
+
+    while (cache->lru_tail &&
+	   (cache->n_cached >= cache->max_cached ||
+	    cache->cached_bytes + size > cache->max_cached_bytes))
     {
-	if (cache->cached_surfaces[i])
-	{
-	    if (delta > 0)
-	    {
-		cache->cached_surfaces[i + delta] =
-		    cache->cached_surfaces[i];
-		
-		assert (cache->cached_surfaces[i + delta]->id != destroy_id);
-		
-		cache->cached_surfaces[i] = NULL;
-	    }
-	}
-	else
-	{
-	    delta++;
-	}
+	qxl_surface_t *destroy_surface = cache->lru_tail;
+
+	cache_remove (cache, destroy_surface);
+	cache->evictions++;
+
+	destroy_surface->lru_next = destroy_surfaces;
+	destroy_surfaces = destroy_surface;
     }
-    
-    assert (delta > 0);
-    
-    cache->cached_surfaces[i + delta] = surface;
-    
-    for (i = 0; i < N_CACHED_SURFACES; ++i)
-	assert (!cache->cached_surfaces[i] || cache->cached_surfaces[i]->id != destroy_id);
+
+    cache_insert (cache, surface);
 
     /* Note that sending a destroy command can trigger callbacks into
      * this function (due to memory management), so we have to
      * do this after updating the cache
      */
-    if (destroy_surface)
+    while (destroy_surfaces)
+    {
+	qxl_surface_t *destroy_surface = destroy_surfaces;
+
+	destroy_surfaces = destroy_surface->lru_next;
+	destroy_surface->lru_next = NULL;
 	qxl_surface_unref (destroy_surface->cache, destroy_surface->id);
+    }
 }
 
 void
@@ -726,6 +1187,7 @@ qxl_surface_kill (qxl_surface_t *surface)
         ev->pixmap = NULL;
         if (ev->image)
             pixman_image_unref (ev->image);
+        qxl_packed_image_free (ev->packed);
         if (ev->next)
             ev->next->prev = ev->prev;
         if (ev->prev)
@@ -741,14 +1203,21 @@ qxl_surface_kill (qxl_surface_t *surface)
         return;
     }
 
+    /* A surface still marked as a tile belongs to a tiled pixmap that
+     * couldn't be created, see destroy_tiles(), and its memory is wanted
+     * right away
+     */
     if (surface->id != 0					&&
-        surface->host_image                                     &&
-	pixman_image_get_width (surface->host_image) >= 128	&&
-	pixman_image_get_height (surface->host_image) >= 128)
+        surface->dev_image                                      &&
+	!surface->tile						&&
+	pixman_image_get_width (surface->dev_image) >= 128	&&
+	pixman_image_get_height (surface->dev_image) >= 128	&&
+	surface_vram_size (surface) <= surface->cache->max_cached_bytes)
     {
 	surface_add_to_cache (surface);
     }
-    
+    surface->tile = FALSE;
+
     qxl_surface_unref (surface->cache, surface->id);
 }
 
@@ -757,38 +1226,76 @@ void *
 qxl_surface_cache_evacuate_all (surface_cache_t *cache)
 {
     evacuated_surface_t *evacuated_surfaces = NULL;
+    unsigned long long raw_bytes = 0, packed_bytes = 0;
     qxl_surface_t *s;
-    int i;
 
-    for (i = 0; i < N_CACHED_SURFACES; ++i)
-    {
-	if (cache->cached_surfaces[i])
-	{
-            surface_destroy (cache->cached_surfaces[i]);
-	    cache->cached_surfaces[i] = NULL;
-	}
+    qxl_upload_worker_sync (cache->qxl);
+
+    qxl_tiled_evacuate_all (cache->qxl);
+
+    while (cache->lru_head)
+    {
+	s = cache->lru_head;
+
+	cache_remove (cache, s);
+	surface_destroy (s);
     }
 
     s = cache->live_surfaces;
     while (s != NULL)
     {
 	qxl_surface_t *next = s->next;
-	evacuated_surface_t *evacuated = malloc (sizeof (evacuated_surface_t));
+	evacuated_surface_t *evacuated = xnfalloc (sizeof (evacuated_surface_t));
 	int width, height;
 
-	width = pixman_image_get_width (s->host_image);
-	height = pixman_image_get_height (s->host_image);
+	width = pixman_image_get_width (s->dev_image);
+	height = pixman_image_get_height (s->dev_image);
+
+	evacuated->image = NULL;
+	evacuated->packed = NULL;
 
-	qxl_download_box (s, 0, 0, width, height);
+	/* Keep the contents packed while the surface is away. If that
+	 * fails, the host image is kept as is. Without a host image, they
+	 * are packed straight from the device.
+	 */
+	if (qxl_surface_ensure_host_image (s))
+	{
+	    qxl_download_box (s, 0, 0, width, height);
+
+	    evacuated->packed = qxl_pack_image (s->host_image);
+	    if (!evacuated->packed)
+		evacuated->image = pixman_image_ref (s->host_image);
+	}
+	else
+	{
+	    cache->qxl->bo_funcs->update_area (s, 0, 0, width, height);
+
+	    evacuated->packed = qxl_pack_image (s->dev_image);
+	}
+
+	if (evacuated->packed)
+	{
+	    raw_bytes += surface_image_size (s);
+	    packed_bytes += qxl_packed_image_size (evacuated->packed);
+	}
+	else if (!evacuated->image)
+	{
+	    ErrorF ("Out of memory evacuating a %dx%d surface, "
+		    "its contents are lost\n", width, height);
+	}
 
-	evacuated->image = s->host_image;
 	evacuated->pixmap = s->pixmap;
 
 	assert (get_surface (evacuated->pixmap) == s);
 	
 	evacuated->bpp = s->bpp;
 	
+	if (s->host_image)
+	    pixman_image_unref (s->host_image);
 	s->host_image = NULL;
+	s->host_image_trackable = FALSE;
+
+	qxl_surface_free_tiles (s);
 
 	unlink_surface (s);
 	
@@ -804,6 +1311,12 @@ qxl_surface_cache_evacuate_all (surface_cache_t *cache)
     cache->live_surfaces = NULL;
     cache->free_surfaces = NULL;
 
+    if (raw_bytes)
+    {
+	ErrorF ("Evacuated surfaces: %llu KB packed into %llu KB\n",
+		raw_bytes >> 10, packed_bytes >> 10);
+    }
+
     return evacuated_surfaces;
 }
 
@@ -812,29 +1325,50 @@ qxl_surface_cache_replace_all (surface_cache_t *cache, void *data)
 {
     evacuated_surface_t *ev;
 
-    if (!surface_cache_init (cache, cache->qxl))
-    {
-	/* FIXME: report the error */
-	return;
-    }
+    surface_cache_init (cache, cache->qxl);
     
     ev = data;
     while (ev != NULL)
     {
 	evacuated_surface_t *next = ev->next;
-	int width = pixman_image_get_width (ev->image);
-	int height = pixman_image_get_height (ev->image);
+	int width, height;
 	qxl_surface_t *surface;
 
+	if (ev->packed)
+	{
+	    /* Restored in the background, see queue_restore() */
+	    queue_restore (cache, ev);
+	    free (ev);
+
+	    ev = next;
+	    continue;
+	}
+
+	if (ev->image)
+	{
+	    width = pixman_image_get_width (ev->image);
+	    height = pixman_image_get_height (ev->image);
+	}
+	else
+	{
+	    /* The contents were lost, see qxl_surface_cache_evacuate_all() */
+	    width = ev->pixmap->drawable.width;
+	    height = ev->pixmap->drawable.height;
+	}
+
 	surface = qxl_surface_create (cache->qxl, width, height, ev->bpp);
 
-	assert (surface->host_image);
 	assert (surface->dev_image);
 
-	pixman_image_unref (surface->host_image);
-	surface->host_image = ev->image;
+	if (ev->image)
+	{
+	    if (surface->host_image)
+		pixman_image_unref (surface->host_image);
+	    surface->host_image = ev->image;
+	    surface->host_image_trackable = FALSE;
 
-	qxl_upload_box (surface, 0, 0, width, height);
+	    qxl_upload_box (surface, 0, 0, width, height);
+	}
 
 	set_surface (ev->pixmap, surface);
 
@@ -845,6 +1379,632 @@ qxl_surface_cache_replace_all (surface_cache_t *cache, void *data)
 	ev = next;
     }
 
+    if (cache->spilled)
+    {
+	cache->restore_timer =
+	    TimerSet (cache->restore_timer, 0, RESTORE_INTERVAL,
+		      restore_timer_callback, cache);
+    }
+
     qxl_surface_cache_sanity_check (cache);
 
 }
+
+/* Moving surfaces to system memory
+ *
+ * When a surface can't be allocated in video memory, its pixmap is
+ * rendered in software for its whole life, while surfaces nobody draws
+ * to any more keep their video memory. So under pressure, the surfaces
+ * the device has used least recently are read back, and their pixmaps
+ * turned into ordinary system memory pixmaps. When such a pixmap gets
+ * busy again and there is room, it is moved back.
+ *
+ * Everything happens from a timer, between requests, so no pixmap is
+ * being drawn to while it moves. To avoid thrashing, surfaces must be
+ * idle for a while before they are moved out, and stay out for a while
+ * before they can come back. Surfaces are moved out until free memory
+ * reaches the high mark, and only moved back while it stays above it.
+ */
+#define SPILL_MIN_IDLE		5000
+#define SPILL_MIN_HOST_TIME	3000
+#define SPILL_HOT_USES		8
+#define SPILL_MAX_PER_TICK	32
+
+/* With the MigratePixmaps option, pixmaps also move according to how
+ * they are used. A surface that is mostly accessed by software, which
+ * means reading it back from the device each time, is moved to system
+ * memory even when there is no shortage of video memory.
+ *
+ * Software accesses to pixmaps in system memory don't go through the
+ * driver, so the only measure of how busy such a pixmap is remains the
+ * number of times UXA looked at it, software accesses included. To keep
+ * a pixmap from going back and forth, a demoted pixmap must stay out
+ * longer and be used much more than a spilled one before it is moved
+ * back. Since busy software pixmaps still look hot that way, the time
+ * it has to stay out doubles each time the same pixmap is demoted again.
+ */
+#define MIGRATE_MIN_ACCESSES	16
+#define MIGRATE_DEMOTE_RATIO	4
+#define MIGRATE_MIN_HOST_TIME	10000
+#define MIGRATE_MAX_BACKOFF	6
+#define MIGRATE_HOT_USES	64
+
+/* Returns FALSE if the pixmap has no pixels that software could use
+ * yet, because there was no memory to unpack them. It then stays packed
+ * until the next use or the restore timer.
+ */
+Bool
+qxl_surface_spilled_use (surface_cache_t *cache, qxl_spilled_pixmap_t *spilled)
+{
+    spilled->uses++;
+
+    /* UXA may be in the middle of an operation, so don't create a
+     * surface now. The pixmap can't wait for the background restore
+     * either, but unpacking it into system memory is enough.
+     */
+    if (!spilled->image)
+	return unpack_pixmap (cache, spilled);
+
+    return TRUE;
+}
+
+static void
+spilled_link (surface_cache_t *cache, qxl_spilled_pixmap_t *spilled)
+{
+    spilled->prev = NULL;
+    spilled->next = cache->spilled;
+    if (cache->spilled)
+	cache->spilled->prev = spilled;
+    cache->spilled = spilled;
+}
+
+static void
+spilled_unlink (surface_cache_t *cache, qxl_spilled_pixmap_t *spilled)
+{
+    if (spilled->prev)
+	spilled->prev->next = spilled->next;
+    else
+	cache->spilled = spilled->next;
+    if (spilled->next)
+	spilled->next->prev = spilled->prev;
+}
+
+void
+qxl_surface_spilled_destroy (surface_cache_t *cache, PixmapPtr pixmap)
+{
+    qxl_spilled_pixmap_t *spilled = get_spilled (pixmap);
+
+    spilled_unlink (cache, spilled);
+    set_spilled (pixmap, NULL);
+
+    if (spilled->image)
+	pixman_image_unref (spilled->image);
+    qxl_packed_image_free (spilled->packed);
+    free (spilled);
+}
+
+/* Make pixmap an ordinary pixmap in system memory, backed by image.
+ * The pixmap owns the image from now on. Like queue_restore(), this
+ * can't fail, since the image would have no other owner.
+ */
+void
+qxl_surface_spilled_adopt (surface_cache_t *cache, PixmapPtr pixmap,
+			   pixman_image_t *image, int bpp)
+{
+    ScreenPtr pScreen = pixmap->drawable.pScreen;
+    qxl_spilled_pixmap_t *spilled = xnfalloc (sizeof *spilled);
+
+    spilled->pixmap = pixmap;
+    spilled->image = image;
+    spilled->packed = NULL;
+    spilled->bpp = bpp;
+    spilled->uses = 0;
+    spilled->demoted = FALSE;
+    spilled->demotions = 0;
+    spilled->restore = FALSE;
+    spilled->spilled_at = GetTimeInMillis ();
+
+    spilled_link (cache, spilled);
+
+    set_spilled (pixmap, spilled);
+
+    pScreen->ModifyPixmapHeader (pixmap,
+				 pixmap->drawable.width,
+				 pixmap->drawable.height,
+				 -1, -1,
+				 pixman_image_get_stride (image),
+				 pixman_image_get_data (image));
+}
+
+static Bool
+spill_surface (surface_cache_t *cache, qxl_surface_t *surface, CARD32 now)
+{
+    PixmapPtr pixmap = surface->pixmap;
+    ScreenPtr pScreen = pixmap->drawable.pScreen;
+    qxl_spilled_pixmap_t *spilled;
+    pixman_image_t *image;
+
+    if (!(spilled = malloc (sizeof *spilled)))
+	return FALSE;
+
+    if (!qxl_surface_ensure_host_image (surface))
+    {
+	free (spilled);
+	return FALSE;
+    }
+
+    /* The pixmap is about to be drawn to by software */
+    qxl_upload_worker_wait (cache->qxl, surface->upload_seq);
+
+    qxl_download_box (surface, 0, 0,
+		      pixman_image_get_width (surface->dev_image),
+		      pixman_image_get_height (surface->dev_image));
+
+    image = surface->host_image;
+    surface->host_image = NULL;
+    surface->host_image_trackable = FALSE;
+
+    spilled->pixmap = pixmap;
+    spilled->image = image;
+    spilled->packed = NULL;
+    spilled->bpp = surface->bpp;
+    spilled->uses = 0;
+    spilled->demoted = FALSE;
+    spilled->demotions = surface->demotions;
+    spilled->restore = FALSE;
+    spilled->spilled_at = now;
+
+    spilled_link (cache, spilled);
+
+    set_surface (pixmap, NULL);
+    set_spilled (pixmap, spilled);
+
+    pScreen->ModifyPixmapHeader (pixmap,
+				 pixmap->drawable.width,
+				 pixmap->drawable.height,
+				 -1, -1,
+				 pixman_image_get_stride (image),
+				 pixman_image_get_data (image));
+
+    /* Destroying the surface may be delayed by commands still using it */
+    unlink_surface (surface);
+    qxl_surface_unref (cache, surface->id);
+
+    return TRUE;
+}
+
+/* About the video memory a spilled pixmap takes once promoted, see
+ * surface_send_create()
+ */
+static long
+spilled_vram_size (qxl_spilled_pixmap_t *spilled)
+{
+    pixman_format_code_t format;
+    int width, height;
+
+    if (spilled->image)
+    {
+	return (long)pixman_image_get_stride (spilled->image) *
+	    (pixman_image_get_height (spilled->image) + 1);
+    }
+
+    qxl_packed_image_get_info (spilled->packed, &format, &width, &height);
+
+    return (long)width * PIXMAN_FORMAT_BPP (format) / 8 * (height + 1);
+}
+
+static Bool
+promote_pixmap (surface_cache_t *cache, qxl_spilled_pixmap_t *spilled, CARD32 now)
+{
+    PixmapPtr pixmap = spilled->pixmap;
+    ScreenPtr pScreen = pixmap->drawable.pScreen;
+    int width = pixman_image_get_width (spilled->image);
+    int height = pixman_image_get_height (spilled->image);
+    qxl_surface_t *surface;
+
+    surface = qxl_surface_create (cache->qxl, width, height, spilled->bpp);
+    if (!surface)
+	return FALSE;
+
+    /* A surface from the cache may be larger than the image */
+    if (pixman_image_get_width (surface->dev_image) == width &&
+	pixman_image_get_height (surface->dev_image) == height)
+    {
+	if (surface->host_image)
+	    pixman_image_unref (surface->host_image);
+	surface->host_image = pixman_image_ref (spilled->image);
+	surface->host_image_trackable = FALSE;
+    }
+    else
+    {
+	if (!qxl_surface_ensure_host_image (surface))
+	{
+	    qxl_surface_kill (surface);
+	    return FALSE;
+	}
+
+	pixman_image_composite (PIXMAN_OP_SRC, spilled->image, NULL,
+				surface->host_image,
+				0, 0, 0, 0, 0, 0, width, height);
+    }
+
+    qxl_upload_box (surface, 0, 0, width, height);
+    surface->last_use = now;
+    surface->demotions = spilled->demotions;
+
+    qxl_surface_spilled_destroy (cache, pixmap);
+
+    set_surface (pixmap, surface);
+    qxl_surface_set_pixmap (surface, pixmap);
+
+    pScreen->ModifyPixmapHeader (pixmap,
+				 pixmap->drawable.width,
+				 pixmap->drawable.height,
+				 -1, -1, 0, NULL);
+
+    cache->promotions++;
+
+    return TRUE;
+}
+
+static int
+compare_last_use (const void *a, const void *b)
+{
+    const qxl_surface_t *sa = *(qxl_surface_t * const *)a;
+    const qxl_surface_t *sb = *(qxl_surface_t * const *)b;
+
+    /* Oldest first, with wrap around */
+    return (int32_t)(sa->last_use - sb->last_use);
+}
+
+static void
+spill_idle_surfaces (surface_cache_t *cache, CARD32 now, long needed)
+{
+    qxl_surface_t *candidates[SPILL_MAX_PER_TICK * 4];
+    int n_candidates = 0;
+    qxl_surface_t *s;
+    int i;
+
+    for (s = cache->live_surfaces; s != NULL; s = s->next)
+    {
+	if (!s->pixmap || !REGION_NIL (&s->access_region) ||
+	    now - s->last_use < SPILL_MIN_IDLE)
+	{
+	    continue;
+	}
+
+	if (n_candidates < SPILL_MAX_PER_TICK * 4)
+	{
+	    candidates[n_candidates++] = s;
+	}
+	else
+	{
+	    /* Keep the oldest ones */
+	    int newest = 0;
+
+	    for (i = 1; i < n_candidates; ++i)
+	    {
+		if (compare_last_use (&candidates[i], &candidates[newest]) > 0)
+		    newest = i;
+	    }
+
+	    if (compare_last_use (&s, &candidates[newest]) < 0)
+		candidates[newest] = s;
+	}
+    }
+
+    qsort (candidates, n_candidates, sizeof (qxl_surface_t *), compare_last_use);
+
+    for (i = 0; i < n_candidates && i < SPILL_MAX_PER_TICK && needed > 0; ++i)
+    {
+	int size = surface_vram_size (candidates[i]);
+
+	if (spill_surface (cache, candidates[i], now))
+	{
+	    needed -= size;
+	    cache->spills++;
+	}
+    }
+}
+
+static void
+demote_software_pixmaps (surface_cache_t *cache, CARD32 now)
+{
+    qxl_surface_t *s, *next;
+    int n_demoted = 0;
+
+    for (s = cache->live_surfaces; s != NULL && n_demoted < SPILL_MAX_PER_TICK; s = next)
+    {
+	PixmapPtr pixmap = s->pixmap;
+
+	next = s->next;
+
+	if (!pixmap || !REGION_NIL (&s->access_region))
+	    continue;
+
+	if (s->sw_accesses < MIGRATE_MIN_ACCESSES ||
+	    s->sw_accesses < MIGRATE_DEMOTE_RATIO * s->accel_ops)
+	{
+	    continue;
+	}
+
+	if (spill_surface (cache, s, now))
+	{
+	    get_spilled (pixmap)->demoted = TRUE;
+	    get_spilled (pixmap)->demotions++;
+	    cache->demotions++;
+	    n_demoted++;
+	}
+    }
+}
+
+static int
+compare_uses (const void *a, const void *b)
+{
+    const qxl_spilled_pixmap_t *sa = *(qxl_spilled_pixmap_t * const *)a;
+    const qxl_spilled_pixmap_t *sb = *(qxl_spilled_pixmap_t * const *)b;
+
+    /* Busiest first */
+    return (sb->uses > sa->uses) - (sb->uses < sa->uses);
+}
+
+static void
+promote_hot_pixmaps (surface_cache_t *cache, CARD32 now, long budget)
+{
+    qxl_spilled_pixmap_t *candidates[SPILL_MAX_PER_TICK];
+    qxl_spilled_pixmap_t *spilled;
+    int n_candidates = 0;
+    int i;
+
+    for (spilled = cache->spilled; spilled != NULL; spilled = spilled->next)
+    {
+	if (!spilled->image)
+	    continue;
+
+	if (spilled->demoted)
+	{
+	    int backoff = MIN (spilled->demotions - 1, MIGRATE_MAX_BACKOFF);
+
+	    if (spilled->uses < MIGRATE_HOT_USES ||
+		now - spilled->spilled_at < (CARD32)MIGRATE_MIN_HOST_TIME << backoff)
+	    {
+		continue;
+	    }
+	}
+	else if (spilled->uses < SPILL_HOT_USES ||
+		 now - spilled->spilled_at < SPILL_MIN_HOST_TIME)
+	{
+	    continue;
+	}
+
+	if (n_candidates < SPILL_MAX_PER_TICK)
+	    candidates[n_candidates++] = spilled;
+    }
+
+    qsort (candidates, n_candidates, sizeof (qxl_spilled_pixmap_t *), compare_uses);
+
+    for (i = 0; i < n_candidates; ++i)
+    {
+	long size = spilled_vram_size (candidates[i]);
+
+	if (size > budget)
+	    continue;
+
+	if (promote_pixmap (cache, candidates[i], now))
+	    budget -= size;
+    }
+}
+
+static CARD32
+spill_timer_callback (OsTimerPtr timer, CARD32 now, pointer arg)
+{
+    surface_cache_t *cache = arg;
+    qxl_screen_t *qxl = cache->qxl;
+    long free_bytes, low, high;
+    qxl_spilled_pixmap_t *spilled;
+    qxl_surface_t *s;
+
+    if (!qxl->pScrn->vtSema || !qxl->surf_mem)
+	return SPILL_INTERVAL;
+
+    /* Let surfaces that were already destroyed give back their memory */
+    while (qxl_garbage_collect (qxl))
+	;
+
+    free_bytes = qxl_mem_free_bytes (qxl->surf_mem);
+    low = qxl->vram_size / 16;
+    high = qxl->vram_size / 8;
+
+    if (qxl->migrate_pixmaps)
+	demote_software_pixmaps (cache, now);
+
+    if (qxl->spill_surfaces && (cache->vram_wanted || free_bytes < low))
+    {
+	long needed = MAX (high - free_bytes, (long)cache->vram_wanted);
+
+	spill_idle_surfaces (cache, now, needed);
+	cache->vram_wanted = 0;
+    }
+    else if (free_bytes > high && cache->spilled)
+    {
+	promote_hot_pixmaps (cache, now, free_bytes - high);
+    }
+
+    for (spilled = cache->spilled; spilled != NULL; spilled = spilled->next)
+	spilled->uses = 0;
+
+    for (s = cache->live_surfaces; s != NULL; s = s->next)
+    {
+	s->accel_ops /= 2;
+	s->sw_accesses /= 2;
+    }
+
+    return SPILL_INTERVAL;
+}
+
+/* Restoring evacuated surfaces
+ *
+ * After a VT switch or a resize, evacuated surfaces are not all uploaded
+ * again before the server can go on. Their pixmaps wait in the spilled
+ * list with only their packed contents, and are restored a few at a time
+ * from a timer. When the device has no room for one, it is unpacked into
+ * system memory and becomes an ordinary spilled pixmap.
+ *
+ * UXA may look at a pixmap in the middle of an operation, when no surface
+ * should be created, so a pixmap it looks at before the timer does is
+ * only unpacked into system memory. The timer moves it to the device
+ * later.
+ *
+ * Pixmaps are only restored while the device keeps the same reserve of
+ * free memory as for promotions, see spill_timer_callback(). The others
+ * wait, and the timer tries again every RESTORE_RETRY_INTERVAL, so they
+ * get back to the device even when spilling is disabled.
+ */
+#define RESTORE_PER_TICK 16
+#define RESTORE_RETRY_INTERVAL 1000
+
+static void
+queue_restore (surface_cache_t *cache, evacuated_surface_t *ev)
+{
+    /* The packed contents are all that is left of the pixmap */
+    qxl_spilled_pixmap_t *spilled = xnfalloc (sizeof *spilled);
+
+    set_surface (ev->pixmap, NULL);
+
+    spilled->pixmap = ev->pixmap;
+    spilled->image = NULL;
+    spilled->packed = ev->packed;
+    spilled->bpp = ev->bpp;
+    spilled->uses = 0;
+    spilled->demoted = FALSE;
+    spilled->demotions = 0;
+    spilled->restore = TRUE;
+    spilled->spilled_at = GetTimeInMillis ();
+
+    spilled_link (cache, spilled);
+
+    set_spilled (ev->pixmap, spilled);
+}
+
+static Bool
+restore_pixmap (surface_cache_t *cache, qxl_spilled_pixmap_t *spilled)
+{
+    PixmapPtr pixmap = spilled->pixmap;
+    qxl_surface_t *surface = NULL;
+    pixman_format_code_t format;
+    int width, height;
+
+    qxl_packed_image_get_info (spilled->packed, &format, &width, &height);
+
+    if (cache->qxl->pScrn->vtSema)
+	surface = qxl_surface_create (cache->qxl, width, height, spilled->bpp);
+
+    if (surface && qxl_surface_ensure_host_image (surface))
+    {
+	qxl_unpack_image (spilled->packed, surface->host_image);
+	qxl_upload_box (surface, 0, 0, width, height);
+	surface->last_use = GetTimeInMillis ();
+
+	qxl_surface_spilled_destroy (cache, pixmap);
+
+	set_surface (pixmap, surface);
+	qxl_surface_set_pixmap (surface, pixmap);
+
+	cache->restores++;
+
+	return TRUE;
+    }
+
+    if (surface)
+	qxl_surface_kill (surface);
+
+    /* No room, so it waits in system memory for the next try */
+    unpack_pixmap (cache, spilled);
+
+    return FALSE;
+}
+
+static Bool
+unpack_pixmap (surface_cache_t *cache, qxl_spilled_pixmap_t *spilled)
+{
+    PixmapPtr pixmap = spilled->pixmap;
+    ScreenPtr pScreen = pixmap->drawable.pScreen;
+    pixman_format_code_t format;
+    pixman_image_t *image;
+    int width, height;
+
+    qxl_packed_image_get_info (spilled->packed, &format, &width, &height);
+
+    image = pixman_image_create_bits (format, width, height, NULL, 0);
+    if (!image)
+	return FALSE;
+
+    qxl_unpack_image (spilled->packed, image);
+    qxl_packed_image_free (spilled->packed);
+
+    spilled->packed = NULL;
+    spilled->image = image;
+    spilled->spilled_at = GetTimeInMillis ();
+
+    pScreen->ModifyPixmapHeader (pixmap,
+				 pixmap->drawable.width,
+				 pixmap->drawable.height,
+				 -1, -1,
+				 pixman_image_get_stride (image),
+				 pixman_image_get_data (image));
+
+    return TRUE;
+}
+
+static CARD32
+restore_timer_callback (OsTimerPtr timer, CARD32 now, pointer arg)
+{
+    surface_cache_t *cache = arg;
+    qxl_screen_t *qxl = cache->qxl;
+    qxl_spilled_pixmap_t *spilled, *next;
+    Bool waiting = FALSE;
+    int n_restored = 0;
+    long budget;
+
+    if (!qxl->pScrn->vtSema || !qxl->surf_mem)
+	return RESTORE_INTERVAL;
+
+    while (qxl_garbage_collect (qxl))
+	;
+
+    budget = (long)qxl_mem_free_bytes (qxl->surf_mem) - qxl->vram_size / 8;
+
+    for (spilled = cache->spilled; spilled != NULL; spilled = next)
+    {
+	long size;
+	Bool restored;
+
+	next = spilled->next;
+
+	if (!spilled->restore)
+	    continue;
+
+	size = spilled_vram_size (spilled);
+	if (size > budget)
+	{
+	    waiting = TRUE;
+	    continue;
+	}
+
+	if (n_restored++ == RESTORE_PER_TICK)
+	    return RESTORE_INTERVAL;
+
+	/* Unpacked when UXA looked at it, or when an earlier try failed */
+	if (spilled->image)
+	    restored = promote_pixmap (cache, spilled, now);
+	else
+	    restored = restore_pixmap (cache, spilled);
+
+	if (restored)
+	    budget -= size;
+	else
+	    waiting = TRUE;
+    }
+
+    return waiting ? RESTORE_RETRY_INTERVAL : 0;
+}
@@ -0,0 +1,797 @@
+/*
+ * Copyright 2010 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Tiled pixmaps
+ *
+ * Pixmaps too large to get a surface in one piece, like tall scrolling
+ * canvases, are backed by a grid of surfaces instead, so they can still
+ * be rendered by the device. Solid fills, copies, composites and image
+ * uploads are cut along the tile edges, and each piece is sent to the
+ * surface it falls in.
+ *
+ * For software rendering, the pixmap has a system memory image of its
+ * whole size, and the host image of each tile points into it. So the
+ * usual readback and upload code works per tile, and software rendering
+ * sees one contiguous pixmap.
+ *
+ * Tiled sources and masks of composites are only accelerated without
+ * transform or repeat, since otherwise a piece of the destination could
+ * sample from anywhere in them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "qxl.h"
+#include "qxl_surface.h"
+
+#define TILED_TILE_SIZE 512
+
+/* Tile size used for pixmaps that are not tiled, larger than any pixmap */
+#define NO_TILE_SIZE 65536
+
+struct qxl_tiled_pixmap
+{
+    qxl_screen_t *	qxl;
+    PixmapPtr		pixmap;
+    int			bpp;
+    int			n_tiles_x;
+    int			n_tiles_y;
+    qxl_surface_t **	tiles;
+
+    /* The whole pixmap in system memory, for software rendering */
+    pixman_image_t *	image;
+
+    qxl_tiled_pixmap_t *prev;
+    qxl_tiled_pixmap_t *next;
+};
+
+/* The copy or composite in progress, when a tiled pixmap takes part in
+ * it. UXA only does one at a time.
+ */
+static struct
+{
+    PixmapPtr	dest;
+    PixmapPtr	src;
+    PixmapPtr	mask;
+    int		xdir;
+    int		ydir;
+    int		op;
+    PicturePtr	src_picture;
+    PicturePtr	mask_picture;
+    PicturePtr	dest_picture;
+} current;
+
+/* Iterates over the pieces of a box cut along the edges of square tiles,
+ * in the order given by xdir and ydir, so overlapping copies within a
+ * pixmap read everything before it is overwritten.
+ */
+typedef struct
+{
+    BoxRec	area;
+    int		size;
+    int		xdir;
+    int		ydir;
+    int		y1;
+    int		y2;
+    int		x;
+} pieces_t;
+
+static void
+pieces_init (pieces_t *p, int x1, int y1, int x2, int y2,
+	     int size, int xdir, int ydir)
+{
+    p->area.x1 = x1;
+    p->area.y1 = y1;
+    p->area.x2 = x2;
+    p->area.y2 = y2;
+    p->size = size;
+    p->xdir = xdir;
+    p->ydir = ydir;
+
+    /* Start with an exhausted row before the first one */
+    p->y1 = p->y2 = ydir > 0 ? y1 : y2;
+    p->x = xdir > 0 ? x2 : x1;
+}
+
+static void
+span (int pos, int start, int end, int size, int dir, int *a, int *b)
+{
+    if (dir > 0)
+    {
+	*a = pos;
+	*b = MIN (end, (pos / size + 1) * size);
+    }
+    else
+    {
+	*a = MAX (start, ((pos - 1) / size) * size);
+	*b = pos;
+    }
+}
+
+static Bool
+pieces_next (pieces_t *p, BoxPtr piece)
+{
+    int x1, x2;
+
+    if (p->xdir > 0 ? p->x >= p->area.x2 : p->x <= p->area.x1)
+    {
+	int pos = p->ydir > 0 ? p->y2 : p->y1;
+
+	if (p->ydir > 0 ? pos >= p->area.y2 : pos <= p->area.y1)
+	    return FALSE;
+
+	span (pos, p->area.y1, p->area.y2, p->size, p->ydir, &p->y1, &p->y2);
+	p->x = p->xdir > 0 ? p->area.x1 : p->area.x2;
+    }
+
+    span (p->x, p->area.x1, p->area.x2, p->size, p->xdir, &x1, &x2);
+    p->x = p->xdir > 0 ? x2 : x1;
+
+    piece->x1 = x1;
+    piece->y1 = p->y1;
+    piece->x2 = x2;
+    piece->y2 = p->y2;
+
+    return TRUE;
+}
+
+static int
+tile_size (PixmapPtr pixmap)
+{
+    return (pixmap && get_tiled (pixmap)) ? TILED_TILE_SIZE : NO_TILE_SIZE;
+}
+
+/* The surface holding (x, y) of pixmap, and the position of its
+ * top left corner in the pixmap. A point outside of a tiled pixmap goes
+ * to the nearest tile, where the device samples it outside of the tile
+ * like Render does outside of the pixmap.
+ */
+static qxl_surface_t *
+tile_at (PixmapPtr pixmap, int x, int y, int *ox, int *oy)
+{
+    qxl_tiled_pixmap_t *tiled;
+    int tx, ty;
+
+    if (!pixmap)
+	return NULL;
+
+    if (!(tiled = get_tiled (pixmap)))
+    {
+	*ox = *oy = 0;
+	return get_surface (pixmap);
+    }
+
+    tx = MAX (0, MIN (x / TILED_TILE_SIZE, tiled->n_tiles_x - 1));
+    ty = MAX (0, MIN (y / TILED_TILE_SIZE, tiled->n_tiles_y - 1));
+
+    *ox = tx * TILED_TILE_SIZE;
+    *oy = ty * TILED_TILE_SIZE;
+
+    return tiled->tiles[ty * tiled->n_tiles_x + tx];
+}
+
+/* Every surface of pixmap can be used by the device right now. Sources
+ * of copies may be under software access, see qxl_surface_prepare_copy()
+ */
+static Bool
+pixmap_on_device (PixmapPtr pixmap, Bool copy_source)
+{
+    qxl_tiled_pixmap_t *tiled;
+    qxl_surface_t *surface;
+    int i;
+
+    if (!pixmap)
+	return TRUE;
+
+    if (!(tiled = get_tiled (pixmap)))
+    {
+	surface = get_surface (pixmap);
+
+	return surface &&
+	    (copy_source || REGION_NIL (&surface->access_region));
+    }
+
+    if (copy_source)
+	return TRUE;
+
+    for (i = 0; i < tiled->n_tiles_x * tiled->n_tiles_y; ++i)
+    {
+	if (!REGION_NIL (&tiled->tiles[i]->access_region))
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* The number of surfaces of pixmap, and each of them */
+static int
+n_surfaces (PixmapPtr pixmap)
+{
+    qxl_tiled_pixmap_t *tiled = get_tiled (pixmap);
+
+    return tiled ? tiled->n_tiles_x * tiled->n_tiles_y : 1;
+}
+
+static qxl_surface_t *
+surface_n (PixmapPtr pixmap, int i)
+{
+    qxl_tiled_pixmap_t *tiled;
+
+    if (!pixmap)
+	return NULL;
+
+    if ((tiled = get_tiled (pixmap)))
+	return tiled->tiles[i];
+
+    return get_surface (pixmap);
+}
+
+/* Tiles that are given up are put in the surface cache, unless the
+ * tiled pixmap couldn't be created and their memory is needed now
+ */
+static void
+destroy_tiles (qxl_tiled_pixmap_t *tiled, Bool cache_tiles)
+{
+    qxl_screen_t *qxl = tiled->qxl;
+    int i;
+
+    for (i = 0; i < tiled->n_tiles_x * tiled->n_tiles_y; ++i)
+    {
+	qxl_surface_t *tile = tiled->tiles[i];
+
+	if (!tile)
+	    continue;
+
+	/* The host image points into tiled->image, so it must not
+	 * outlive it, and must not be kept by the surface cache
+	 */
+	if (tile->host_image)
+	{
+	    qxl_upload_worker_wait (qxl, tile->upload_seq);
+
+	    pixman_image_unref (tile->host_image);
+	    tile->host_image = NULL;
+	}
+	tile->tile = !cache_tiles;
+
+	qxl->bo_funcs->destroy_surface (tile);
+    }
+
+    free (tiled->tiles);
+    tiled->tiles = NULL;
+}
+
+static void
+unlink_tiled (qxl_tiled_pixmap_t *tiled)
+{
+    if (tiled->prev)
+	tiled->prev->next = tiled->next;
+    else
+	tiled->qxl->tiled_list = tiled->next;
+    if (tiled->next)
+	tiled->next->prev = tiled->prev;
+}
+
+qxl_tiled_pixmap_t *
+qxl_tiled_create (qxl_screen_t *qxl, int width, int height, int bpp)
+{
+    qxl_tiled_pixmap_t *tiled;
+    pixman_format_code_t format;
+    SpiceSurfaceFmt surface_format;
+    uint8_t *data;
+    int stride, Bpp;
+    int tx, ty;
+
+    if (!qxl->tiled_pixmaps || !qxl->enable_surfaces)
+	return NULL;
+
+    /* Pixmaps that fit in one tile gain nothing */
+    if (width <= TILED_TILE_SIZE && height <= TILED_TILE_SIZE)
+	return NULL;
+
+    qxl_get_formats (bpp, &surface_format, &format);
+    if (format == (pixman_format_code_t)-1)
+	return NULL;
+
+    if (!(tiled = calloc (1, sizeof *tiled)))
+	return NULL;
+
+    tiled->qxl = qxl;
+    tiled->bpp = bpp;
+    tiled->n_tiles_x = (width + TILED_TILE_SIZE - 1) / TILED_TILE_SIZE;
+    tiled->n_tiles_y = (height + TILED_TILE_SIZE - 1) / TILED_TILE_SIZE;
+
+    tiled->tiles = calloc (tiled->n_tiles_x * tiled->n_tiles_y,
+			   sizeof (qxl_surface_t *));
+    tiled->image = pixman_image_create_bits (format, width, height, NULL, -1);
+    if (!tiled->tiles || !tiled->image)
+	goto fail;
+
+    data = (uint8_t *)pixman_image_get_data (tiled->image);
+    stride = pixman_image_get_stride (tiled->image);
+    Bpp = PIXMAN_FORMAT_BPP (format) / 8;
+
+    for (ty = 0; ty < tiled->n_tiles_y; ++ty)
+    {
+	for (tx = 0; tx < tiled->n_tiles_x; ++tx)
+	{
+	    int x = tx * TILED_TILE_SIZE;
+	    int y = ty * TILED_TILE_SIZE;
+	    int w = MIN (TILED_TILE_SIZE, width - x);
+	    int h = MIN (TILED_TILE_SIZE, height - y);
+	    qxl_surface_t *tile;
+
+	    tile = qxl->bo_funcs->create_surface (qxl, w, h, bpp);
+	    if (!tile)
+		goto fail;
+
+	    tiled->tiles[ty * tiled->n_tiles_x + tx] = tile;
+
+	    if (tile->host_image)
+		pixman_image_unref (tile->host_image);
+	    tile->host_image = pixman_image_create_bits (
+		format, w, h, (uint32_t *)(data + y * stride + x * Bpp), stride);
+	    tile->host_image_trackable = FALSE;
+	    tile->tile = TRUE;
+
+	    if (!tile->host_image)
+		goto fail;
+
+	    /* Nothing in the new host image matches the device yet */
+	    qxl_surface_invalidate_tiles (tile, 0, 0, w, h);
+	}
+    }
+
+    tiled->next = qxl->tiled_list;
+    if (qxl->tiled_list)
+	qxl->tiled_list->prev = tiled;
+    qxl->tiled_list = tiled;
+
+    return tiled;
+
+fail:
+    if (tiled->tiles)
+	destroy_tiles (tiled, FALSE);
+    if (tiled->image)
+	pixman_image_unref (tiled->image);
+    free (tiled);
+
+    return NULL;
+}
+
+void
+qxl_tiled_set_pixmap (qxl_tiled_pixmap_t *tiled, PixmapPtr pixmap)
+{
+    tiled->pixmap = pixmap;
+
+    assert (get_tiled (pixmap) == tiled);
+}
+
+/* Placement statistics are counted for the whole pixmap on its first tile */
+qxl_surface_t *
+qxl_tiled_stats_surface (qxl_tiled_pixmap_t *tiled)
+{
+    return tiled->tiles[0];
+}
+
+void
+qxl_tiled_destroy (qxl_tiled_pixmap_t *tiled)
+{
+    destroy_tiles (tiled, TRUE);
+    unlink_tiled (tiled);
+
+    pixman_image_unref (tiled->image);
+    free (tiled);
+}
+
+/* Called before the device loses its surfaces. Tiled pixmaps become
+ * ordinary pixmaps in system memory, which the spill timer may move back
+ * to the device in one piece later.
+ */
+void
+qxl_tiled_evacuate_all (qxl_screen_t *qxl)
+{
+    while (qxl->tiled_list)
+    {
+	qxl_tiled_pixmap_t *tiled = qxl->tiled_list;
+	PixmapPtr pixmap = tiled->pixmap;
+	int i;
+
+	for (i = 0; i < tiled->n_tiles_x * tiled->n_tiles_y; ++i)
+	{
+	    qxl_surface_t *tile = tiled->tiles[i];
+
+	    qxl_download_box (tile, 0, 0,
+			      pixman_image_get_width (tile->host_image),
+			      pixman_image_get_height (tile->host_image));
+	}
+
+	destroy_tiles (tiled, TRUE);
+	unlink_tiled (tiled);
+
+	set_tiled (pixmap, NULL);
+	qxl_surface_spilled_adopt (qxl->surface_cache, pixmap,
+				   tiled->image, tiled->bpp);
+
+	free (tiled);
+    }
+}
+
+/* access */
+Bool
+qxl_tiled_prepare_access (qxl_tiled_pixmap_t *tiled,
+			  PixmapPtr           pixmap,
+			  RegionPtr           region,
+			  uxa_access_t        access)
+{
+    ScreenPtr pScreen = pixmap->drawable.pScreen;
+    ScrnInfoPtr pScrn = xf86ScreenToScrn (pScreen);
+    int tx, ty;
+
+    if (!pScrn->vtSema)
+	return FALSE;
+
+    for (ty = 0; ty < tiled->n_tiles_y; ++ty)
+    {
+	for (tx = 0; tx < tiled->n_tiles_x; ++tx)
+	{
+	    qxl_surface_t *tile = tiled->tiles[ty * tiled->n_tiles_x + tx];
+	    Bool ok = TRUE;
+	    RegionRec r;
+	    BoxRec box;
+
+	    box.x1 = tx * TILED_TILE_SIZE;
+	    box.y1 = ty * TILED_TILE_SIZE;
+	    box.x2 = box.x1 + pixman_image_get_width (tile->host_image);
+	    box.y2 = box.y1 + pixman_image_get_height (tile->host_image);
+
+	    REGION_INIT (NULL, &r, &box, 1);
+	    REGION_INTERSECT (NULL, &r, &r, region);
+
+	    if (REGION_NOTEMPTY (NULL, &r))
+	    {
+		REGION_TRANSLATE (NULL, &r, -box.x1, -box.y1);
+
+		ok = qxl_surface_begin_access (tile, &r, access);
+	    }
+
+	    REGION_UNINIT (NULL, &r);
+
+	    if (!ok)
+	    {
+		qxl_tiled_finish_access (tiled, pixmap);
+		return FALSE;
+	    }
+	}
+    }
+
+    pScreen->ModifyPixmapHeader (pixmap,
+				 pixmap->drawable.width,
+				 pixmap->drawable.height,
+				 -1, -1,
+				 pixman_image_get_stride (tiled->image),
+				 pixman_image_get_data (tiled->image));
+
+    return TRUE;
+}
+
+void
+qxl_tiled_finish_access (qxl_tiled_pixmap_t *tiled, PixmapPtr pixmap)
+{
+    ScreenPtr pScreen = pixmap->drawable.pScreen;
+    int i;
+
+    for (i = 0; i < tiled->n_tiles_x * tiled->n_tiles_y; ++i)
+    {
+	if (REGION_NOTEMPTY (NULL, &tiled->tiles[i]->access_region))
+	    qxl_surface_end_access (tiled->tiles[i]);
+    }
+
+    pScreen->ModifyPixmapHeader (pixmap,
+				 pixmap->drawable.width,
+				 pixmap->drawable.height,
+				 -1, -1, 0, NULL);
+}
+
+/* solid */
+Bool
+qxl_tiled_prepare_solid (qxl_tiled_pixmap_t *tiled, Pixel fg)
+{
+    int i;
+
+    for (i = 0; i < tiled->n_tiles_x * tiled->n_tiles_y; ++i)
+	qxl_surface_prepare_solid (tiled->tiles[i], fg);
+
+    return TRUE;
+}
+
+void
+qxl_tiled_solid (qxl_tiled_pixmap_t *tiled, int x1, int y1, int x2, int y2)
+{
+    pieces_t pieces;
+    BoxRec box;
+
+    pieces_init (&pieces, x1, y1, x2, y2, TILED_TILE_SIZE, 1, 1);
+    while (pieces_next (&pieces, &box))
+    {
+	int tx = box.x1 / TILED_TILE_SIZE;
+	int ty = box.y1 / TILED_TILE_SIZE;
+	int ox = tx * TILED_TILE_SIZE;
+	int oy = ty * TILED_TILE_SIZE;
+
+	qxl_surface_solid (tiled->tiles[ty * tiled->n_tiles_x + tx],
+			   box.x1 - ox, box.y1 - oy, box.x2 - ox, box.y2 - oy);
+    }
+}
+
+/* copy */
+Bool
+qxl_tiled_prepare_copy (PixmapPtr source, PixmapPtr dest, int xdir, int ydir)
+{
+    int i;
+
+    if (!pixmap_on_device (source, TRUE) || !pixmap_on_device (dest, FALSE))
+	return FALSE;
+
+    /* Every tile of dest has to accept the copy, since which ones get
+     * drawn to isn't known yet
+     */
+    for (i = 0; i < n_surfaces (dest); ++i)
+    {
+	if (!qxl_surface_prepare_copy (surface_n (dest, i), surface_n (source, 0)))
+	    return FALSE;
+    }
+
+    memset (&current, 0, sizeof current);
+    current.dest = dest;
+    current.src = source;
+    current.xdir = xdir;
+    current.ydir = ydir;
+
+    return TRUE;
+}
+
+Bool
+qxl_tiled_busy (PixmapPtr dest)
+{
+    return current.dest == dest;
+}
+
+void
+qxl_tiled_copy (PixmapPtr dest,
+		int src_x1, int src_y1,
+		int dest_x1, int dest_y1,
+		int width, int height)
+{
+    int dx = src_x1 - dest_x1;
+    int dy = src_y1 - dest_y1;
+    pieces_t dest_pieces;
+    BoxRec d;
+
+    pieces_init (&dest_pieces, dest_x1, dest_y1,
+		 dest_x1 + width, dest_y1 + height,
+		 tile_size (dest), current.xdir, current.ydir);
+
+    while (pieces_next (&dest_pieces, &d))
+    {
+	pieces_t src_pieces;
+	BoxRec s;
+
+	pieces_init (&src_pieces, d.x1 + dx, d.y1 + dy, d.x2 + dx, d.y2 + dy,
+		     tile_size (current.src), current.xdir, current.ydir);
+
+	while (pieces_next (&src_pieces, &s))
+	{
+	    qxl_surface_t *src_tile, *dest_tile;
+	    int sox, soy, dox, doy;
+
+	    src_tile = tile_at (current.src, s.x1, s.y1, &sox, &soy);
+	    dest_tile = tile_at (dest, s.x1 - dx, s.y1 - dy, &dox, &doy);
+
+	    /* Checked for every tile by qxl_tiled_prepare_copy() */
+	    if (!qxl_surface_prepare_copy (dest_tile, src_tile))
+		continue;
+
+	    qxl_surface_copy (dest_tile,
+			      s.x1 - sox, s.y1 - soy,
+			      s.x1 - dx - dox, s.y1 - dy - doy,
+			      s.x2 - s.x1, s.y2 - s.y1);
+	}
+    }
+}
+
+/* composite */
+static Bool
+can_sample_tiled (PicturePtr picture, PixmapPtr pixmap)
+{
+    if (!pixmap || !get_tiled (pixmap))
+	return TRUE;
+
+    return !picture->transform && !picture->repeat;
+}
+
+Bool
+qxl_tiled_prepare_composite (int        op,
+			     PicturePtr src_picture,
+			     PicturePtr mask_picture,
+			     PicturePtr dest_picture,
+			     PixmapPtr  src,
+			     PixmapPtr  mask,
+			     PixmapPtr  dest)
+{
+    int i;
+
+    if (!can_sample_tiled (src_picture, src) ||
+	!can_sample_tiled (mask_picture, mask))
+    {
+	return FALSE;
+    }
+
+    if (!pixmap_on_device (src, FALSE) || !pixmap_on_device (mask, FALSE) ||
+	!pixmap_on_device (dest, FALSE))
+    {
+	return FALSE;
+    }
+
+    for (i = 0; i < n_surfaces (dest); ++i)
+    {
+	if (!qxl_surface_prepare_composite (op, src_picture, mask_picture,
+					    dest_picture, surface_n (src, 0),
+					    surface_n (mask, 0),
+					    surface_n (dest, i)))
+	{
+	    return FALSE;
+	}
+    }
+
+    memset (&current, 0, sizeof current);
+    current.dest = dest;
+    current.src = src;
+    current.mask = mask;
+    current.xdir = current.ydir = 1;
+    current.op = op;
+    current.src_picture = src_picture;
+    current.mask_picture = mask_picture;
+    current.dest_picture = dest_picture;
+
+    return TRUE;
+}
+
+/* Composite the piece d of the destination, which lies within one
+ * tile of each of the pixmaps
+ */
+static void
+composite_piece (BoxPtr d, int sdx, int sdy, int mdx, int mdy)
+{
+    qxl_surface_t *src_tile, *mask_tile, *dest_tile;
+    int sox, soy, mox = 0, moy = 0, dox, doy;
+
+    dest_tile = tile_at (current.dest, d->x1, d->y1, &dox, &doy);
+    src_tile = tile_at (current.src, d->x1 + sdx, d->y1 + sdy, &sox, &soy);
+    mask_tile = tile_at (current.mask, d->x1 + mdx, d->y1 + mdy, &mox, &moy);
+
+    /* Checked for every tile by qxl_tiled_prepare_composite() */
+    if (!qxl_surface_prepare_composite (current.op,
+					current.src_picture,
+					current.mask_picture,
+					current.dest_picture,
+					src_tile, mask_tile, dest_tile))
+    {
+	return;
+    }
+
+    qxl_surface_composite (dest_tile,
+			   d->x1 + sdx - sox, d->y1 + sdy - soy,
+			   d->x1 + mdx - mox, d->y1 + mdy - moy,
+			   d->x1 - dox, d->y1 - doy,
+			   d->x2 - d->x1, d->y2 - d->y1);
+}
+
+void
+qxl_tiled_composite (PixmapPtr dest,
+		     int src_x, int src_y,
+		     int mask_x, int mask_y,
+		     int dest_x, int dest_y,
+		     int width, int height)
+{
+    int sdx = src_x - dest_x, sdy = src_y - dest_y;
+    int mdx = mask_x - dest_x, mdy = mask_y - dest_y;
+    pieces_t dest_pieces;
+    BoxRec d;
+
+    /* Cut along the tiles of the destination, then of the source, then
+     * of the mask
+     */
+    pieces_init (&dest_pieces, dest_x, dest_y, dest_x + width, dest_y + height,
+		 tile_size (dest), 1, 1);
+
+    while (pieces_next (&dest_pieces, &d))
+    {
+	pieces_t src_pieces;
+	BoxRec s;
+
+	pieces_init (&src_pieces, d.x1 + sdx, d.y1 + sdy, d.x2 + sdx, d.y2 + sdy,
+		     tile_size (current.src), 1, 1);
+
+	while (pieces_next (&src_pieces, &s))
+	{
+	    pieces_t mask_pieces;
+	    BoxRec m;
+
+	    pieces_init (&mask_pieces,
+			 s.x1 - sdx + mdx, s.y1 - sdy + mdy,
+			 s.x2 - sdx + mdx, s.y2 - sdy + mdy,
+			 tile_size (current.mask), 1, 1);
+
+	    while (pieces_next (&mask_pieces, &m))
+	    {
+		BoxRec piece;
+
+		piece.x1 = m.x1 - mdx;
+		piece.y1 = m.y1 - mdy;
+		piece.x2 = m.x2 - mdx;
+		piece.y2 = m.y2 - mdy;
+
+		composite_piece (&piece, sdx, sdy, mdx, mdy);
+	    }
+	}
+    }
+}
+
+void
+qxl_tiled_done (PixmapPtr dest)
+{
+    if (current.dest == dest)
+	memset (&current, 0, sizeof current);
+}
+
+/* put image */
+Bool
+qxl_tiled_put_image (qxl_tiled_pixmap_t *tiled,
+		     int x, int y, int width, int height,
+		     const char *src, int src_pitch)
+{
+    int Bpp = tiled->pixmap->drawable.bitsPerPixel / 8;
+    pieces_t pieces;
+    BoxRec box;
+
+    pieces_init (&pieces, x, y, x + width, y + height, TILED_TILE_SIZE, 1, 1);
+    while (pieces_next (&pieces, &box))
+    {
+	int tx = box.x1 / TILED_TILE_SIZE;
+	int ty = box.y1 / TILED_TILE_SIZE;
+
+	qxl_surface_put_image (tiled->tiles[ty * tiled->n_tiles_x + tx],
+			       box.x1 - tx * TILED_TILE_SIZE,
+			       box.y1 - ty * TILED_TILE_SIZE,
+			       box.x2 - box.x1, box.y2 - box.y1,
+			       src + (box.y1 - y) * src_pitch + (box.x1 - x) * Bpp,
+			       src_pitch);
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,295 @@
+/*
+ * Copyright 2009, 2010 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Write tracking
+ *
+ * After a software fallback, only the rows the fallback actually wrote
+ * need to be uploaded. To find them, host images are allocated page
+ * aligned with mmap, and while a surface is being accessed read-write
+ * its host image is made read-only. The first write to each page faults;
+ * the SIGSEGV handler records the page as dirty and makes it writable
+ * again. Faults outside of tracked images are passed on to the handler
+ * that was installed before.
+ *
+ * Only a few surfaces are accessed at the same time, so they are kept in
+ * a small fixed table that the signal handler can search without locks.
+ * The table is only modified by the X thread, and never while a tracked
+ * page can fault.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "qxl.h"
+#include "qxl_surface.h"
+
+#define MAX_TRACKED 8
+
+typedef struct
+{
+    qxl_surface_t *	surface;
+    uintptr_t		start;
+    uintptr_t		end;
+    uint32_t *		dirty;
+} tracked_image_t;
+
+static tracked_image_t tracked[MAX_TRACKED];
+static struct sigaction old_action;
+static int n_users;
+static size_t page_size;
+
+static void
+segv_handler (int sig, siginfo_t *info, void *context)
+{
+    uintptr_t addr = (uintptr_t)info->si_addr;
+    int i;
+
+    for (i = 0; i < MAX_TRACKED; ++i)
+    {
+	tracked_image_t *t = &tracked[i];
+
+	if (t->surface && addr >= t->start && addr < t->end)
+	{
+	    size_t page = (addr - t->start) / page_size;
+
+	    t->dirty[page >> 5] |= 1U << (page & 31);
+	    mprotect ((void *)(t->start + page * page_size), page_size,
+		      PROT_READ | PROT_WRITE);
+	    return;
+	}
+    }
+
+    /* Not ours */
+    if (old_action.sa_flags & SA_SIGINFO)
+    {
+	old_action.sa_sigaction (sig, info, context);
+    }
+    else if (old_action.sa_handler == SIG_DFL ||
+	     old_action.sa_handler == SIG_IGN)
+    {
+	/* The faulting instruction is restarted and gets the default
+	 * action this time.
+	 */
+	signal (sig, SIG_DFL);
+    }
+    else
+    {
+	old_action.sa_handler (sig);
+    }
+}
+
+Bool
+qxl_track_init (qxl_screen_t *qxl)
+{
+    struct sigaction action;
+
+    if (n_users++)
+	return TRUE;
+
+    page_size = sysconf (_SC_PAGESIZE);
+
+    memset (&action, 0, sizeof action);
+    action.sa_sigaction = segv_handler;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset (&action.sa_mask);
+
+    if (sigaction (SIGSEGV, &action, &old_action) < 0)
+    {
+	n_users--;
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
+void
+qxl_track_fini (qxl_screen_t *qxl)
+{
+    if (--n_users)
+	return;
+
+    sigaction (SIGSEGV, &old_action, NULL);
+}
+
+static size_t
+image_map_size (pixman_image_t *image)
+{
+    size_t size = pixman_image_get_stride (image) * pixman_image_get_height (image);
+
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
+static void
+unmap_bits (pixman_image_t *image, void *data)
+{
+    munmap (data, image_map_size (image));
+}
+
+/* Host images have to be created with this function to be tracked. The
+ * bits start on a page boundary and the last page is not shared with
+ * anything else.
+ */
+pixman_image_t *
+qxl_track_create_image (pixman_format_code_t format, int width, int height)
+{
+    int stride = ((width * PIXMAN_FORMAT_BPP (format) + 31) / 32) * 4;
+    size_t size = ((size_t)stride * height + page_size - 1) & ~(page_size - 1);
+    pixman_image_t *image;
+    void *bits;
+
+    bits = mmap (NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bits == MAP_FAILED)
+	return NULL;
+
+    image = pixman_image_create_bits (format, width, height, bits, stride);
+    if (!image)
+    {
+	munmap (bits, size);
+	return NULL;
+    }
+
+    pixman_image_set_destroy_function (image, unmap_bits, bits);
+
+    return image;
+}
+
+static tracked_image_t *
+find_tracked (qxl_surface_t *surface)
+{
+    int i;
+
+    for (i = 0; i < MAX_TRACKED; ++i)
+    {
+	if (tracked[i].surface == surface)
+	    return &tracked[i];
+    }
+
+    return NULL;
+}
+
+/* Start recording writes to the host image of surface. Calling this
+ * again before qxl_track_end() does nothing, so pages written in
+ * between stay dirty.
+ */
+Bool
+qxl_track_begin (qxl_surface_t *surface)
+{
+    tracked_image_t *t;
+    size_t size, n_pages;
+
+    if (!surface->host_image_trackable)
+	return FALSE;
+
+    if (find_tracked (surface))
+	return TRUE;
+
+    if (!(t = find_tracked (NULL)))
+	return FALSE;
+
+    size = image_map_size (surface->host_image);
+    n_pages = size / page_size;
+
+    t->dirty = calloc ((n_pages + 31) / 32, sizeof (uint32_t));
+    if (!t->dirty)
+	return FALSE;
+
+    t->start = (uintptr_t)pixman_image_get_data (surface->host_image);
+    t->end = t->start + size;
+
+    if (mprotect ((void *)t->start, size, PROT_READ) < 0)
+    {
+	free (t->dirty);
+	t->dirty = NULL;
+	return FALSE;
+    }
+
+    t->surface = surface;
+
+    return TRUE;
+}
+
+/* Stop recording writes to the host image of surface, and add the rows
+ * that may have been written to dirty. Returns FALSE if writes were not
+ * being recorded, in which case the whole access region has to be
+ * considered dirty.
+ */
+Bool
+qxl_track_end (qxl_surface_t *surface, RegionPtr dirty)
+{
+    tracked_image_t *t = find_tracked (surface);
+    int stride, width, height;
+    size_t n_pages, page;
+
+    if (!t)
+	return FALSE;
+
+    mprotect ((void *)t->start, t->end - t->start, PROT_READ | PROT_WRITE);
+
+    stride = pixman_image_get_stride (surface->host_image);
+    width = pixman_image_get_width (surface->host_image);
+    height = pixman_image_get_height (surface->host_image);
+    n_pages = (t->end - t->start) / page_size;
+
+    page = 0;
+    while (page < n_pages)
+    {
+	size_t first;
+	BoxRec box;
+	RegionRec r;
+
+	if (!(t->dirty[page >> 5] & (1U << (page & 31))))
+	{
+	    page++;
+	    continue;
+	}
+
+	/* Adjacent dirty pages become one band of rows */
+	first = page;
+	while (page < n_pages && (t->dirty[page >> 5] & (1U << (page & 31))))
+	    page++;
+
+	box.x1 = 0;
+	box.x2 = width;
+	box.y1 = first * page_size / stride;
+	box.y2 = MIN ((page * page_size + stride - 1) / stride, height);
+
+	if (box.y1 >= box.y2)
+	    continue;
+
+	REGION_INIT (NULL, &r, &box, 1);
+	REGION_UNION (NULL, dirty, dirty, &r);
+	REGION_UNINIT (NULL, &r);
+    }
+
+    free (t->dirty);
+    memset (t, 0, sizeof *t);
+
+    return TRUE;
+}
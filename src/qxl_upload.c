@@ -0,0 +1,467 @@
+/*
+ * Copyright 2009, 2010 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Upload worker
+ *
+ * Copying and hashing the rows of large fallback uploads is moved to a
+ * separate thread. The X thread still allocates the chunks and builds the
+ * image and drawable, since the allocator is not thread safe; only the
+ * pixel data is filled in later.
+ *
+ * Every job gets a sequence number. While jobs are outstanding, commands
+ * are not written to the ring directly but queued together with the
+ * sequence number of the last job submitted before them. A command is
+ * written once that job has completed, so the device sees commands in
+ * the order they were issued and never sees an image before its data.
+ *
+ * The source image is referenced by the job, and the X thread must call
+ * qxl_upload_worker_wait() before drawing to it again.
+ *
+ * The X thread only waits for the worker where the order requires it:
+ * before reading back or drawing to a source, before the device updates
+ * an area, and when memory runs out. Commands left queued when it goes
+ * idle are written from a timer as their jobs complete.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qxl.h"
+
+/* How often queued commands are checked for while the server is idle, in
+ * milliseconds
+ */
+#define FLUSH_POLL_INTERVAL 1
+
+typedef struct
+{
+    const uint8_t *	src;
+    int			src_stride;
+    uint8_t *		dest;
+    int			dest_stride;
+    int			n_lines;
+} upload_rows_t;
+
+struct qxl_upload_job
+{
+    qxl_upload_job_t *	next;
+    uint32_t		seq;
+
+    pixman_image_t *	source;
+    int			Bpp;
+    int			width;
+
+    /* Where to store the hash of the image, or NULL */
+    uint64_t *		id;
+
+    upload_rows_t *	rows;
+    int			n_rows;
+    int			n_rows_alloc;
+};
+
+typedef struct
+{
+    uint32_t		type;
+    struct qxl_bo *	bo;
+    uint32_t		seq;
+} pending_command_t;
+
+struct qxl_upload_worker
+{
+    pthread_t		thread;
+    pthread_mutex_t	mutex;
+    pthread_cond_t	job_cond;
+    pthread_cond_t	done_cond;
+
+    /* Protected by mutex */
+    qxl_upload_job_t *	queue_head;
+    qxl_upload_job_t *	queue_tail;
+    qxl_upload_job_t *	done;
+    uint32_t		completed_seq;
+    Bool		quit;
+
+    /* Only touched by the X thread */
+    uint32_t		submitted_seq;
+    pending_command_t *	commands;
+    int			n_commands;
+    int			n_commands_alloc;
+    OsTimerPtr		flush_timer;
+};
+
+static void reap (qxl_screen_t *qxl);
+
+static Bool
+seq_passed (uint32_t seq, uint32_t completed)
+{
+    return (int32_t)(completed - seq) >= 0;
+}
+
+static void
+run_job (qxl_upload_job_t *job)
+{
+    uint32_t hash = 0;
+    int i;
+
+    for (i = 0; i < job->n_rows; ++i)
+    {
+	upload_rows_t *rows = &job->rows[i];
+
+	hash = qxl_image_hash_and_copy (rows->src, rows->src_stride,
+					rows->dest, rows->dest_stride,
+					job->Bpp, job->width, rows->n_lines,
+					hash);
+    }
+
+    if (job->id)
+	*job->id = hash;
+}
+
+static void *
+worker_main (void *data)
+{
+    struct qxl_upload_worker *worker = data;
+
+    pthread_mutex_lock (&worker->mutex);
+
+    while (!worker->quit)
+    {
+	qxl_upload_job_t *job;
+
+	if (!worker->queue_head)
+	{
+	    pthread_cond_wait (&worker->job_cond, &worker->mutex);
+	    continue;
+	}
+
+	job = worker->queue_head;
+	worker->queue_head = job->next;
+	if (!worker->queue_head)
+	    worker->queue_tail = NULL;
+
+	pthread_mutex_unlock (&worker->mutex);
+
+	run_job (job);
+
+	pthread_mutex_lock (&worker->mutex);
+
+	/* Jobs are run in order, so this is also the highest sequence
+	 * number completed so far.
+	 */
+	worker->completed_seq = job->seq;
+	job->next = worker->done;
+	worker->done = job;
+
+	pthread_cond_broadcast (&worker->done_cond);
+    }
+
+    pthread_mutex_unlock (&worker->mutex);
+
+    return NULL;
+}
+
+static CARD32
+flush_timer_callback (OsTimerPtr timer, CARD32 time, pointer arg)
+{
+    qxl_screen_t *qxl = arg;
+
+    reap (qxl);
+
+    return qxl->upload_worker->n_commands ? FLUSH_POLL_INTERVAL : 0;
+}
+
+/* Called before the server flushes output to clients and goes to sleep.
+ * Commands still queued at that point must reach the device without
+ * waiting for the next request, but waiting for the worker here would
+ * stall the X thread after nearly every batch of requests. So they are
+ * written from a timer instead.
+ */
+static void
+flush_callback (CallbackListPtr *list, pointer user_data, pointer call_data)
+{
+    qxl_screen_t *qxl = user_data;
+    struct qxl_upload_worker *worker = qxl->upload_worker;
+
+    reap (qxl);
+
+    if (worker->n_commands)
+    {
+	worker->flush_timer = TimerSet (worker->flush_timer, 0,
+					FLUSH_POLL_INTERVAL,
+					flush_timer_callback, qxl);
+    }
+}
+
+Bool
+qxl_upload_worker_init (qxl_screen_t *qxl)
+{
+    struct qxl_upload_worker *worker;
+
+    worker = calloc (1, sizeof *worker);
+    if (!worker)
+	return FALSE;
+
+    pthread_mutex_init (&worker->mutex, NULL);
+    pthread_cond_init (&worker->job_cond, NULL);
+    pthread_cond_init (&worker->done_cond, NULL);
+
+    if (pthread_create (&worker->thread, NULL, worker_main, worker) != 0)
+    {
+	pthread_cond_destroy (&worker->done_cond);
+	pthread_cond_destroy (&worker->job_cond);
+	pthread_mutex_destroy (&worker->mutex);
+	free (worker);
+	return FALSE;
+    }
+
+    qxl->upload_worker = worker;
+
+    AddCallback (&FlushCallback, flush_callback, qxl);
+
+    return TRUE;
+}
+
+void
+qxl_upload_worker_fini (qxl_screen_t *qxl)
+{
+    struct qxl_upload_worker *worker = qxl->upload_worker;
+
+    if (!worker)
+	return;
+
+    DeleteCallback (&FlushCallback, flush_callback, qxl);
+    TimerFree (worker->flush_timer);
+
+    qxl_upload_worker_sync (qxl);
+
+    pthread_mutex_lock (&worker->mutex);
+    worker->quit = TRUE;
+    pthread_cond_signal (&worker->job_cond);
+    pthread_mutex_unlock (&worker->mutex);
+
+    pthread_join (worker->thread, NULL);
+
+    pthread_cond_destroy (&worker->done_cond);
+    pthread_cond_destroy (&worker->job_cond);
+    pthread_mutex_destroy (&worker->mutex);
+
+    free (worker->commands);
+    free (worker);
+
+    qxl->upload_worker = NULL;
+}
+
+qxl_upload_job_t *
+qxl_upload_job_new (pixman_image_t *source, int Bpp, int width)
+{
+    qxl_upload_job_t *job = calloc (1, sizeof *job);
+
+    if (!job)
+	return NULL;
+
+    job->source = pixman_image_ref (source);
+    job->Bpp = Bpp;
+    job->width = width;
+
+    return job;
+}
+
+void
+qxl_upload_job_free (qxl_upload_job_t *job)
+{
+    pixman_image_unref (job->source);
+    free (job->rows);
+    free (job);
+}
+
+Bool
+qxl_upload_job_add_rows (qxl_upload_job_t *job,
+			 const uint8_t *src, int src_stride,
+			 uint8_t *dest, int dest_stride, int n_lines)
+{
+    upload_rows_t *rows;
+
+    if (job->n_rows == job->n_rows_alloc)
+    {
+	int n_alloc = job->n_rows_alloc ? job->n_rows_alloc * 2 : 8;
+
+	rows = realloc (job->rows, n_alloc * sizeof (upload_rows_t));
+	if (!rows)
+	    return FALSE;
+
+	job->rows = rows;
+	job->n_rows_alloc = n_alloc;
+    }
+
+    rows = &job->rows[job->n_rows++];
+    rows->src = src;
+    rows->src_stride = src_stride;
+    rows->dest = dest;
+    rows->dest_stride = dest_stride;
+    rows->n_lines = n_lines;
+
+    return TRUE;
+}
+
+void
+qxl_upload_job_set_id (qxl_upload_job_t *job, uint64_t *id)
+{
+    job->id = id;
+}
+
+uint32_t
+qxl_upload_job_submit (qxl_screen_t *qxl, qxl_upload_job_t *job)
+{
+    struct qxl_upload_worker *worker = qxl->upload_worker;
+
+    job->seq = ++worker->submitted_seq;
+    job->next = NULL;
+
+    pthread_mutex_lock (&worker->mutex);
+
+    if (worker->queue_tail)
+	worker->queue_tail->next = job;
+    else
+	worker->queue_head = job;
+    worker->queue_tail = job;
+
+    pthread_cond_signal (&worker->job_cond);
+    pthread_mutex_unlock (&worker->mutex);
+
+    return job->seq;
+}
+
+/* Release finished jobs and write the commands that no longer wait for
+ * any job. Pixman reference counts are not atomic, so the source images
+ * are unreferenced here rather than in the worker.
+ */
+static void
+reap (qxl_screen_t *qxl)
+{
+    struct qxl_upload_worker *worker = qxl->upload_worker;
+    qxl_upload_job_t *done;
+    uint32_t completed;
+    int i;
+
+    pthread_mutex_lock (&worker->mutex);
+    done = worker->done;
+    worker->done = NULL;
+    completed = worker->completed_seq;
+    pthread_mutex_unlock (&worker->mutex);
+
+    while (done)
+    {
+	qxl_upload_job_t *next = done->next;
+
+	qxl_upload_job_free (done);
+	done = next;
+    }
+
+    for (i = 0; i < worker->n_commands; ++i)
+    {
+	pending_command_t *cmd = &worker->commands[i];
+
+	if (!seq_passed (cmd->seq, completed))
+	    break;
+
+	qxl_ums_submit_command (qxl, cmd->type, cmd->bo);
+    }
+
+    worker->n_commands -= i;
+    memmove (worker->commands, worker->commands + i,
+	     worker->n_commands * sizeof (pending_command_t));
+}
+
+Bool
+qxl_upload_worker_queue_command (qxl_screen_t *qxl, uint32_t type,
+				 struct qxl_bo *bo)
+{
+    struct qxl_upload_worker *worker = qxl->upload_worker;
+    pending_command_t *cmd;
+
+    reap (qxl);
+
+    if (worker->n_commands == 0)
+    {
+	uint32_t completed;
+
+	pthread_mutex_lock (&worker->mutex);
+	completed = worker->completed_seq;
+	pthread_mutex_unlock (&worker->mutex);
+
+	if (seq_passed (worker->submitted_seq, completed))
+	    return FALSE;
+    }
+
+    if (worker->n_commands == worker->n_commands_alloc)
+    {
+	int n_alloc = worker->n_commands_alloc ? worker->n_commands_alloc * 2 : 64;
+	pending_command_t *commands =
+	    realloc (worker->commands, n_alloc * sizeof (pending_command_t));
+
+	if (!commands)
+	{
+	    /* Keep the order by waiting for everything instead */
+	    qxl_upload_worker_sync (qxl);
+	    return FALSE;
+	}
+
+	worker->commands = commands;
+	worker->n_commands_alloc = n_alloc;
+    }
+
+    cmd = &worker->commands[worker->n_commands++];
+    cmd->type = type;
+    cmd->bo = bo;
+    cmd->seq = worker->submitted_seq;
+
+    return TRUE;
+}
+
+void
+qxl_upload_worker_wait (qxl_screen_t *qxl, uint32_t seq)
+{
+    struct qxl_upload_worker *worker = qxl->upload_worker;
+
+    if (!worker)
+	return;
+
+    pthread_mutex_lock (&worker->mutex);
+    while (!seq_passed (seq, worker->completed_seq))
+	pthread_cond_wait (&worker->done_cond, &worker->mutex);
+    pthread_mutex_unlock (&worker->mutex);
+
+    reap (qxl);
+}
+
+void
+qxl_upload_worker_sync (qxl_screen_t *qxl)
+{
+    if (!qxl->upload_worker)
+	return;
+
+    qxl_upload_worker_wait (qxl, qxl->upload_worker->submitted_seq);
+}
@@ -39,13 +39,41 @@
 
 #if HAS_DEVPRIVATEKEYREC
 DevPrivateKeyRec uxa_pixmap_index;
+DevPrivateKeyRec qxl_spilled_pixmap_index;
+DevPrivateKeyRec qxl_tiled_pixmap_index;
 #else
 int uxa_pixmap_index;
+int qxl_spilled_pixmap_index;
+int qxl_tiled_pixmap_index;
 #endif
 
+/* The surface that keeps the placement statistics of pixmap, the first
+ * tile for tiled pixmaps
+ */
+static qxl_surface_t *
+stats_surface (PixmapPtr pixmap)
+{
+    qxl_tiled_pixmap_t *tiled = get_tiled (pixmap);
+
+    return tiled ? qxl_tiled_stats_surface (tiled) : get_surface (pixmap);
+}
+
 static Bool
 qxl_prepare_access (PixmapPtr pixmap, RegionPtr region, uxa_access_t access)
 {
+    qxl_tiled_pixmap_t *tiled = get_tiled (pixmap);
+
+    qxl_placement_count (stats_surface (pixmap), FALSE);
+
+    if (tiled)
+	return qxl_tiled_prepare_access (tiled, pixmap, region, access);
+
+    /* A pixmap whose pixels couldn't be unpacked, see
+     * qxl_pixmap_is_offscreen()
+     */
+    if (!get_surface (pixmap))
+	return FALSE;
+
     return qxl_surface_prepare_access (get_surface (pixmap),
                                        pixmap, region, access);
 }
@@ -53,13 +81,36 @@ qxl_prepare_access (PixmapPtr pixmap, RegionPtr region, uxa_access_t access)
 static void
 qxl_finish_access (PixmapPtr pixmap)
 {
-    qxl_surface_finish_access (get_surface (pixmap), pixmap);
+    qxl_tiled_pixmap_t *tiled = get_tiled (pixmap);
+
+    if (tiled)
+	qxl_tiled_finish_access (tiled, pixmap);
+    else
+	qxl_surface_finish_access (get_surface (pixmap), pixmap);
 }
 
 static Bool
 qxl_pixmap_is_offscreen (PixmapPtr pixmap)
 {
-    return !!get_surface (pixmap);
+    qxl_spilled_pixmap_t *spilled = get_spilled (pixmap);
+
+    /* UXA asks this for every pixmap it is about to draw with, so it
+     * tells how busy a pixmap in system memory is, and evacuated pixmaps
+     * get restored here
+     */
+    if (spilled)
+    {
+	ScrnInfoPtr scrn = xf86ScreenToScrn (pixmap->drawable.pScreen);
+	qxl_screen_t *qxl = scrn->driverPrivate;
+
+	/* Software can't draw to a pixmap that has no pixels, so claim it
+	 * is off-screen and let qxl_prepare_access() refuse it
+	 */
+	if (!qxl_surface_spilled_use (qxl->surface_cache, spilled))
+	    return TRUE;
+    }
+
+    return get_surface (pixmap) || get_tiled (pixmap);
 }
 
 static Bool
@@ -89,18 +140,36 @@ qxl_check_solid (DrawablePtr drawable, int alu, Pixel planemask)
 static Bool
 qxl_prepare_solid (PixmapPtr pixmap, int alu, Pixel planemask, Pixel fg)
 {
+    qxl_tiled_pixmap_t *tiled;
     qxl_surface_t *surface;
 
-    if (!(surface = get_surface (pixmap)))
-	return FALSE;
+    if ((tiled = get_tiled (pixmap)))
+    {
+	if (!qxl_tiled_prepare_solid (tiled, fg))
+	    return FALSE;
+    }
+    else
+    {
+	if (!(surface = get_surface (pixmap)))
+	    return FALSE;
+
+	if (!qxl_surface_prepare_solid (surface, fg))
+	    return FALSE;
+    }
 
-    return qxl_surface_prepare_solid (surface, fg);
+    qxl_placement_count (stats_surface (pixmap), TRUE);
+    return TRUE;
 }
 
 static void
 qxl_solid (PixmapPtr pixmap, int x1, int y1, int x2, int y2)
 {
-    qxl_surface_solid (get_surface (pixmap), x1, y1, x2, y2);
+    qxl_tiled_pixmap_t *tiled = get_tiled (pixmap);
+
+    if (tiled)
+	qxl_tiled_solid (tiled, x1, y1, x2, y2);
+    else
+	qxl_surface_solid (get_surface (pixmap), x1, y1, x2, y2);
 }
 
 static void
@@ -132,7 +201,19 @@ qxl_prepare_copy (PixmapPtr source, PixmapPtr dest,
                   int xdir, int ydir, int alu,
                   Pixel planemask)
 {
-    return qxl_surface_prepare_copy (get_surface (dest), get_surface (source));
+    if (get_tiled (source) || get_tiled (dest))
+    {
+	if (!qxl_tiled_prepare_copy (source, dest, xdir, ydir))
+	    return FALSE;
+    }
+    else if (!get_surface (dest) || !get_surface (source) ||
+	     !qxl_surface_prepare_copy (get_surface (dest), get_surface (source)))
+    {
+	return FALSE;
+    }
+
+    qxl_placement_count (stats_surface (dest), TRUE);
+    return TRUE;
 }
 
 static void
@@ -141,6 +222,12 @@ qxl_copy (PixmapPtr dest,
           int dest_x1, int dest_y1,
           int width, int height)
 {
+    if (qxl_tiled_busy (dest))
+    {
+	qxl_tiled_copy (dest, src_x1, src_y1, dest_x1, dest_y1, width, height);
+	return;
+    }
+
     qxl_surface_copy (get_surface (dest),
                       src_x1, src_y1,
                       dest_x1, dest_y1,
@@ -150,6 +237,7 @@ qxl_copy (PixmapPtr dest,
 static void
 qxl_done_copy (PixmapPtr dest)
 {
+    qxl_tiled_done (dest);
 }
 
 /*
@@ -360,11 +448,27 @@ qxl_prepare_composite (int op,
 		       PixmapPtr pMask,
 		       PixmapPtr pDst)
 {
-    return qxl_surface_prepare_composite (
-	op, pSrcPicture, pMaskPicture, pDstPicture,
-	get_surface (pSrc),
-	pMask? get_surface (pMask) : NULL,
-	get_surface (pDst));
+    if (get_tiled (pSrc) || (pMask && get_tiled (pMask)) || get_tiled (pDst))
+    {
+	if (!qxl_tiled_prepare_composite (
+		op, pSrcPicture, pMaskPicture, pDstPicture, pSrc, pMask, pDst))
+	{
+	    return FALSE;
+	}
+    }
+    else if (!get_surface (pSrc) || (pMask && !get_surface (pMask)) ||
+	     !get_surface (pDst) ||
+	     !qxl_surface_prepare_composite (
+		 op, pSrcPicture, pMaskPicture, pDstPicture,
+		 get_surface (pSrc),
+		 pMask? get_surface (pMask) : NULL,
+		 get_surface (pDst)))
+    {
+	return FALSE;
+    }
+
+    qxl_placement_count (stats_surface (pDst), TRUE);
+    return TRUE;
 }
 
 static void
@@ -374,6 +478,13 @@ qxl_composite (PixmapPtr pDst,
 	       int dst_x, int dst_y,
 	       int width, int height)
 {
+    if (qxl_tiled_busy (pDst))
+    {
+	qxl_tiled_composite (pDst, src_x, src_y, mask_x, mask_y,
+			     dst_x, dst_y, width, height);
+	return;
+    }
+
     qxl_surface_composite (
 	get_surface (pDst),
 	src_x, src_y,
@@ -384,7 +495,7 @@ qxl_composite (PixmapPtr pDst,
 static void
 qxl_done_composite (PixmapPtr pDst)
 {
-    ;
+    qxl_tiled_done (pDst);
 }
 
 static Bool
@@ -392,9 +503,25 @@ qxl_put_image (PixmapPtr pDst, int x, int y, int w, int h,
                char *src, int src_pitch)
 {
     qxl_surface_t *surface = get_surface (pDst);
+    qxl_tiled_pixmap_t *tiled = get_tiled (pDst);
 
     if (surface)
-	return qxl_surface_put_image (surface, x, y, w, h, src, src_pitch);
+    {
+	if (!qxl_surface_put_image (surface, x, y, w, h, src, src_pitch))
+	    return FALSE;
+
+	qxl_placement_count (surface, TRUE);
+	return TRUE;
+    }
+
+    if (tiled)
+    {
+	if (!qxl_tiled_put_image (tiled, x, y, w, h, src, src_pitch))
+	    return FALSE;
+
+	qxl_placement_count (stats_surface (pDst), TRUE);
+	return TRUE;
+    }
 
     return FALSE;
 }
@@ -412,6 +539,8 @@ qxl_create_pixmap (ScreenPtr screen, int w, int h, int depth, unsigned usage)
     PixmapPtr      pixmap;
     qxl_screen_t * qxl = scrn->driverPrivate;
     qxl_surface_t *surface;
+    qxl_tiled_pixmap_t *tiled;
+    int usage_class = qxl_placement_class (usage);
 
     if (w > 32767 || h > 32767)
 	return NULL;
@@ -439,11 +568,16 @@ qxl_create_pixmap (ScreenPtr screen, int w, int h, int depth, unsigned usage)
     if (!w || !h)
       goto fallback;
 
+    if (!qxl_placement_on_device (qxl, w, h, depth, usage_class))
+	goto fallback;
+
     surface = qxl->bo_funcs->create_surface (qxl, w, h, depth);
     if (surface)
     {
 	/* ErrorF ("   Successfully created surface in video memory\n"); */
 
+	qxl_placement_created (surface, usage_class);
+
 	pixmap = fbCreatePixmap (screen, 0, 0, depth, usage);
 
 	screen->ModifyPixmapHeader (pixmap, w, h,
@@ -458,12 +592,31 @@ qxl_create_pixmap (ScreenPtr screen, int w, int h, int depth, unsigned usage)
 
 	qxl_surface_cache_sanity_check (qxl->surface_cache);
     }
+    else if ((tiled = qxl_tiled_create (qxl, w, h, depth)))
+    {
+	pixmap = fbCreatePixmap (screen, 0, 0, depth, usage);
+	if (!pixmap)
+	{
+	    qxl_tiled_destroy (tiled);
+	    return NULL;
+	}
+
+	qxl_placement_created (qxl_tiled_stats_surface (tiled), usage_class);
+
+	screen->ModifyPixmapHeader (pixmap, w, h,
+	                            -1, -1, -1,
+	                            NULL);
+
+	set_tiled (pixmap, tiled);
+	qxl_tiled_set_pixmap (tiled, pixmap);
+    }
     else
     {
 #if 0
 	ErrorF ("   Couldn't allocate %d x %d @ %d surface in video memory\n",
 	        w, h, depth);
 #endif
+	qxl->placement_stats[usage_class].failed++;
     fallback:
 	pixmap = fbCreatePixmap (screen, w, h, depth, usage);
 
@@ -500,6 +653,15 @@ qxl_destroy_pixmap (PixmapPtr pixmap)
 
 	    qxl_surface_cache_sanity_check (qxl->surface_cache);
 	}
+	else if (get_spilled (pixmap))
+	{
+	    qxl_surface_spilled_destroy (qxl->surface_cache, pixmap);
+	}
+	else if (get_tiled (pixmap))
+	{
+	    qxl_tiled_destroy (get_tiled (pixmap));
+	    set_tiled (pixmap, NULL);
+	}
     }
 
     fbDestroyPixmap (pixmap);
@@ -551,9 +713,17 @@ qxl_uxa_init (qxl_screen_t *qxl, ScreenPtr screen)
 #if HAS_DIXREGISTERPRIVATEKEY
     if (!dixRegisterPrivateKey (&uxa_pixmap_index, PRIVATE_PIXMAP, 0))
 	return FALSE;
+    if (!dixRegisterPrivateKey (&qxl_spilled_pixmap_index, PRIVATE_PIXMAP, 0))
+	return FALSE;
+    if (!dixRegisterPrivateKey (&qxl_tiled_pixmap_index, PRIVATE_PIXMAP, 0))
+	return FALSE;
 #else
     if (!dixRequestPrivate (&uxa_pixmap_index, 0))
 	return FALSE;
+    if (!dixRequestPrivate (&qxl_spilled_pixmap_index, 0))
+	return FALSE;
+    if (!dixRequestPrivate (&qxl_tiled_pixmap_index, 0))
+	return FALSE;
 #endif
 
     qxl->uxa = uxa_driver_alloc ();